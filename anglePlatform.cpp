@@ -0,0 +1,171 @@
+// anglePlatform.cpp: an angle::Platform that forwards ANGLE's trace events
+//   into ezview's trace, so driver-side costs line up with ezview's own spans.
+//   ANGLE's entry points are looked up at run time, so ezview still runs on
+//   other GLES drivers, where installing the platform simply does nothing.
+
+#include "platform/Platform.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+extern "C"
+{
+
+// From ezview.c
+double currentTime();
+void traceSpan(const char* name, int track, double start, double duration);
+extern int tracing;
+
+int installANGLEPlatform();
+void removeANGLEPlatform();
+
+}
+
+namespace
+{
+
+const int kTraceTrack = 3;	// TRACE_ANGLE in ezview.c
+const int kMaxDepth = 64;
+
+struct OpenEvent
+{
+    const char *name;
+    double start;
+};
+
+// Events ANGLE has begun but not yet ended, innermost last
+thread_local OpenEvent openEvents[kMaxDepth];
+thread_local int openDepth;
+
+unsigned char categoryEnabled;
+
+class EzviewPlatform : public angle::Platform
+{
+  public:
+    double currentTime() override
+    {
+        using namespace std::chrono;
+        return duration_cast<duration<double>>(system_clock::now().time_since_epoch()).count();
+    }
+
+    // ANGLE's timestamps come from here, so they share ezview's clock
+    double monotonicallyIncreasingTime() override { return ::currentTime(); }
+
+    void logError(const char *errorMessage) override { fprintf(stderr, "ANGLE error: %s\n", errorMessage); }
+
+    void logWarning(const char *warningMessage) override { fprintf(stderr, "ANGLE warning: %s\n", warningMessage); }
+
+    const unsigned char *getTraceCategoryEnabledFlag(const char *categoryName) override
+    {
+        return &categoryEnabled;
+    }
+
+    TraceEventHandle addTraceEvent(char phase,
+                                   const unsigned char *categoryEnabledFlag,
+                                   const char *name,
+                                   unsigned long long id,
+                                   double timestamp,
+                                   int numArgs,
+                                   const char **argNames,
+                                   const unsigned char *argTypes,
+                                   const unsigned long long *argValues,
+                                   unsigned char flags) override
+    {
+        // Copied names are kept for the life of the trace, which is the run
+        if (flags & 0x1)
+        {
+            name = strdup(name);
+        }
+
+        switch (phase)
+        {
+          case 'B':
+          case 'X':
+            if (openDepth == kMaxDepth)
+            {
+                return 0;
+            }
+            openEvents[openDepth].name = name;
+            openEvents[openDepth].start = timestamp;
+            return ++openDepth;
+
+          case 'E':
+            if (openDepth > 0)
+            {
+                openDepth--;
+                traceSpan(openEvents[openDepth].name, kTraceTrack, openEvents[openDepth].start,
+                          timestamp - openEvents[openDepth].start);
+            }
+            return 0;
+
+          case 'I':
+            traceSpan(name, kTraceTrack, timestamp, 0);
+            return 0;
+
+          default:
+            return 0;
+        }
+    }
+
+    void updateTraceEventDuration(const unsigned char *categoryEnabledFlag, const char *name, TraceEventHandle eventHandle) override
+    {
+        if (eventHandle == 0 || eventHandle > (TraceEventHandle)openDepth)
+        {
+            return;
+        }
+
+        // Anything opened inside the event and never closed ends with it
+        openDepth = (int)eventHandle - 1;
+        traceSpan(openEvents[openDepth].name, kTraceTrack, openEvents[openDepth].start,
+                  ::currentTime() - openEvents[openDepth].start);
+    }
+};
+
+EzviewPlatform platform;
+ANGLEPlatformShutdownFunc shutdownPlatform;
+
+void *findANGLEFunction(const char *name)
+{
+#ifdef _WIN32
+    HMODULE library = GetModuleHandleA("libGLESv2.dll");
+    return library != NULL ? (void *)GetProcAddress(library, name) : NULL;
+#else
+    return dlsym(RTLD_DEFAULT, name);
+#endif
+}
+
+}
+
+// Hands ezview's platform to ANGLE. Returns 0 when the driver is not ANGLE.
+int installANGLEPlatform()
+{
+    ANGLEPlatformInitializeFunc initializePlatform =
+        (ANGLEPlatformInitializeFunc)findANGLEFunction("ANGLEPlatformInitialize");
+
+    shutdownPlatform = (ANGLEPlatformShutdownFunc)findANGLEFunction("ANGLEPlatformShutdown");
+    if (initializePlatform == NULL || shutdownPlatform == NULL)
+    {
+        return 0;
+    }
+
+    categoryEnabled = tracing ? 1 : 0;
+    initializePlatform(&platform);
+    return 1;
+}
+
+void removeANGLEPlatform()
+{
+    if (shutdownPlatform != NULL)
+    {
+        categoryEnabled = 0;
+        shutdownPlatform();
+        shutdownPlatform = NULL;
+    }
+}
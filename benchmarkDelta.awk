@@ -0,0 +1,35 @@
+# Compares two runs of ezview --benchmark line by line, printing how each
+# figure changed from the first file to the second.
+#
+#   awk -f benchmarkDelta.awk before.jsonl after.jsonl
+
+function value(line, name,    fields, count, i) {
+	count = split(line, fields, /[{}:,"]+/)
+	for (i = 2; i < count; i += 2) {
+		if (fields[i] == name) {
+			return fields[i + 1]
+		}
+	}
+	return 0
+}
+
+FNR == NR {
+	before[FNR] = $0
+	next
+}
+
+{
+	count = split("decode_ms upload_ms gpu_fps cpu_fps", names, " ")
+	printf "%s %sx%s", value($0, "format"), value($0, "width"), value($0, "height")
+	for (i = 1; i <= count; i++) {
+		old = value(before[FNR], names[i])
+		new = value($0, names[i])
+		# Mapped images are decoded by the upload, so they have no decode figures
+		if (old == "null" || new == "null") {
+			printf "  %s n/a", names[i]
+			continue
+		}
+		printf "  %s %.2f -> %.2f (%+.1f%%)", names[i], old, new, (old > 0 ? (new - old) * 100 / old : 0)
+	}
+	printf "\n"
+}
@@ -1,7 +1,11 @@
 #define GLFW_DLL 1
+#define _FILE_OFFSET_BITS 64	// Files over 2 GiB on 32 bit Linux
 
 #define GL_GLEXT_PROTOTYPES
 #include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <GLFW/glfw3.h>
 
 #include "linmath.h"
@@ -10,6 +14,36 @@
 #include <stdio.h>
 #include <math.h>
 #include <assert.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <process.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define EZVIEW_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__SSSE3__) || defined(__AVX__)
+#define EZVIEW_SSSE3 1
+#include <tmmintrin.h>
+#endif
 
 #define PI acos(-1.0)
 
@@ -18,14 +52,6 @@ typedef struct {
   float TexCoord[2];
 } Vertex;
 
-Vertex vertexes[] = {
-  {{1, -1}, {0.99999, 0}},
-  {{1, 1},  {0.99999, 0.99999}},
-  {{-1, 1}, {0, 0.99999}},
-  {{-1, -1}, {0, 0}},
-  {{1, -1}, {0.99999, 0}}
-};
-
 static const char* vertex_shader_text =
 "uniform mat4 MVP;\n"
 "attribute vec2 TexCoordIn;\n"
@@ -51,6 +77,9 @@ float trans_y = 0;
 float scale = 1;
 float shear = 0;
 
+int frame_dirty = 1;	// Set by anything that changes what is on screen
+int continuous_rendering;	// Redraw every vblank even when nothing changed
+
 static void error_callback(int error, const char* description)
 {
     fprintf(stderr, "Error: %s\n", description);
@@ -58,6 +87,8 @@ static void error_callback(int error, const char* description)
 
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+    frame_dirty = 1;
+
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
         glfwSetWindowShouldClose(window, 1);
     } else if (key == GLFW_KEY_E && action == GLFW_PRESS) {
@@ -83,6 +114,16 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
     }
 }
 
+static void framebuffer_size_callback(GLFWwindow* window, int width, int height)
+{
+    frame_dirty = 1;
+}
+
+static void window_refresh_callback(GLFWwindow* window)
+{
+    frame_dirty = 1;
+}
+
 void glCompileShaderOrDie(GLuint shader) {
   GLint compiled;
   glCompileShader(shader);
@@ -102,287 +143,4258 @@ void glCompileShaderOrDie(GLuint shader) {
   }
 }
 
-int ppmFileType;
-int maxColorValue;
+typedef struct {
+	int type;	// '3' or '6'
+	int maxColorValue;
+	int sampleBytes;	// 1, or 2 when maxColorValue is over 255
+	int width;
+	int height;
+	unsigned char* pixels;
+	unsigned char* mapping;	// Set when the file is mapped; P6 pixels then point into it
+	size_t mappingSize;
+	size_t headerSize;	// Bytes before the raster
+	unsigned short* scale;	// Rescales samples to the full range while decoding, NULL when they already are
+	const char* path;	// Where the viewed image was opened, for its row index; NULL otherwise
+	long long* rowOffsets;	// P3 only: where every P3_INDEX_ROWS-th row starts in the file, NULL when unknown
+	int rowIndexLoaded;	// rowOffsets came from the sidecar rather than being filled in while decoding
+	int singleThreaded;	// Set where several images are decoded at once, one per thread
+} PPMImage;
+
+PPMImage image;	// The image being viewed
+
+// Multiplies two sizes, exiting rather than wrapping around when the product
+// cannot be addressed.
+size_t checkedMultiply(size_t a, size_t b) {
+	if (b != 0 && a > SIZE_MAX / b) {
+		fprintf(stderr, "Error: Image is too large.\n");
+		exit(1);
+	}
+	return a * b;
+}
+
+// Bytes in the decoded raster of ppm.
+size_t imageSize(const PPMImage* ppm) {
+	return checkedMultiply(checkedMultiply(checkedMultiply(ppm->width, ppm->height), 3), ppm->sampleBytes);
+}
 
-int image_width;
-int image_height;
+// The position in fh, which can be past 2 GiB even where long is 32 bits.
+long long fileOffset(FILE* fh) {
+#ifdef _WIN32
+	return _ftelli64(fh);
+#else
+	return ftello(fh);
+#endif
+}
 
-unsigned char* image;
+int seekFile(FILE* fh, long long offset) {
+#ifdef _WIN32
+	return _fseeki64(fh, offset, SEEK_SET) == 0;
+#else
+	return fseeko(fh, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
 
-void getPPMFileType(FILE* fh) {
-	char PPMFileType [4];
+// Reads count bytes at offset in the file behind fh without using its
+// position, so several threads can read one file at once. Returns 0 when the
+// file ends first.
+int readFileAt(FILE* fh, void* buffer, size_t count, long long offset) {
+	unsigned char* out = buffer;
 
-	if (fgets(PPMFileType, 4, fh) != NULL) {
-		if (!strcmp(PPMFileType, "P3\n")) {
-			ppmFileType = '3';
-		} else if (!strcmp(PPMFileType, "P6\n")) {
-			ppmFileType = '6';
-		} else {
-			fprintf(stderr, "Error: Not a PPM file. Incompatible file type.\n");
-			exit(1);
+	while (count > 0) {
+#ifdef _WIN32
+		OVERLAPPED overlapped = { 0 };
+		DWORD chunk = count < 0x40000000 ? (DWORD)count : 0x40000000;
+		DWORD got;
+
+		overlapped.Offset = (DWORD)offset;
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+		if (!ReadFile((HANDLE)_get_osfhandle(_fileno(fh)), out, chunk, &got, &overlapped) || got == 0) {
+			return 0;
+		}
+#else
+		ssize_t got = pread(fileno(fh), out, count, (off_t)offset);
+
+		if (got < 0 && errno == EINTR) {
+			continue;
 		}
+		if (got <= 0) {
+			return 0;
+		}
+#endif
+		out += got;
+		count -= got;
+		offset += got;
 	}
+	return 1;
 }
 
-void getWidthAndHeight(FILE* fh) {
-	char value[20];
+int worker_threads;	// 0 until set by --threads or the CPU count
 
-	while ((value[0] = fgetc(fh)) == '#') {	// Line is a comment
-		while (fgetc(fh) != '\n');	// Ignore the line
-	}
+#ifdef _WIN32
+typedef HANDLE Thread;
+typedef unsigned ThreadResult;
+#define THREAD_CALL __stdcall
+#else
+typedef pthread_t Thread;
+typedef void* ThreadResult;
+#define THREAD_CALL
+#endif
 
-	if (!isdigit(value[0])) {
-		fprintf(stderr, "Error: Image width is not valid.\n");
-		exit(1);
+int startThread(Thread* thread, ThreadResult (THREAD_CALL *run)(void*), void* arg) {
+#ifdef _WIN32
+	*thread = (HANDLE)_beginthreadex(NULL, 0, run, arg, 0, NULL);
+	return *thread != 0;
+#else
+	return pthread_create(thread, NULL, run, arg) == 0;
+#endif
+}
+
+void joinThread(Thread thread) {
+#ifdef _WIN32
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif
+}
+
+void sleepThread() {
+#ifdef _WIN32
+	Sleep(1);
+#else
+	usleep(1000);
+#endif
+}
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Condition;
+#else
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Condition;
+#endif
+
+void initMutex(Mutex* mutex) {
+#ifdef _WIN32
+	InitializeCriticalSection(mutex);
+#else
+	pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void lockMutex(Mutex* mutex) {
+#ifdef _WIN32
+	EnterCriticalSection(mutex);
+#else
+	pthread_mutex_lock(mutex);
+#endif
+}
+
+void unlockMutex(Mutex* mutex) {
+#ifdef _WIN32
+	LeaveCriticalSection(mutex);
+#else
+	pthread_mutex_unlock(mutex);
+#endif
+}
+
+void initCondition(Condition* condition) {
+#ifdef _WIN32
+	InitializeConditionVariable(condition);
+#else
+	pthread_cond_init(condition, NULL);
+#endif
+}
+
+void waitCondition(Condition* condition, Mutex* mutex) {
+#ifdef _WIN32
+	SleepConditionVariableCS(condition, mutex, INFINITE);
+#else
+	pthread_cond_wait(condition, mutex);
+#endif
+}
+
+void broadcastCondition(Condition* condition) {
+#ifdef _WIN32
+	WakeAllConditionVariable(condition);
+#else
+	pthread_cond_broadcast(condition);
+#endif
+}
+
+double currentTime() {
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+long atomicIncrement(volatile long* value) {
+#ifdef _WIN32
+	return InterlockedIncrement(value);
+#else
+	return __sync_add_and_fetch(value, 1);
+#endif
+}
+
+long atomicLoad(volatile long* value) {
+#ifdef _WIN32
+	long result = *value;
+	MemoryBarrier();
+	return result;
+#else
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+void atomicStore(volatile long* value, long result) {
+#ifdef _WIN32
+	MemoryBarrier();
+	*value = result;
+#else
+	__atomic_store_n(value, result, __ATOMIC_RELEASE);
+#endif
+}
+
+typedef struct {
+	void (*job)(void* context, int index);
+	void* context;
+	int count;
+	volatile long next;
+} ParallelJob;
+
+ThreadResult THREAD_CALL runParallelJob(void* arg) {
+	ParallelJob* work = arg;
+	int index;
+
+	while ((index = (int)atomicIncrement(&work->next) - 1) < work->count) {
+		work->job(work->context, index);
 	}
+	return 0;
+}
 
-	int i = 1;
-	while ((value[i] = fgetc(fh)) != ' ') {
-		if (!isdigit(value[i])) {
-			fprintf(stderr, "Error: Image width is not valid.\n");
-			exit(1);
+int getWorkerThreads() {
+	if (worker_threads < 1) {
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		worker_threads = info.dwNumberOfProcessors;
+#else
+		worker_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (worker_threads < 1) {
+			worker_threads = 1;
 		}
-		i++;
 	}
-	value[i] = '\0';
-	image_width = atoi(value);
+	return worker_threads;
+}
 
-	i = 0;
-	while ((value[i] = fgetc(fh)) != '\n') {
-		if (!isdigit(value[i])) {
-			fprintf(stderr, "Error: Image height is not valid.\n");
-			exit(1);
+// Runs job(context, 0..count-1) across the worker threads, the calling thread
+// included, and returns once every index has finished.
+void parallelFor(int count, void (*job)(void* context, int index), void* context) {
+	ParallelJob work = { job, context, count, 0 };
+	int threads = getWorkerThreads() < count ? getWorkerThreads() : count;
+	Thread* handles = malloc(sizeof(Thread) * threads);
+	int started = 0;
+
+	for (int i = 1; handles != NULL && i < threads; i++) {
+		if (startThread(&handles[started], runParallelJob, &work)) {
+			started++;
 		}
-		i++;
 	}
-	value[i] = '\0';
-	image_height = atoi(value);
+	runParallelJob(&work);
+	for (int i = 0; i < started; i++) {
+		joinThread(handles[i]);
+	}
+	free(handles);
 }
 
-void getMaxColorValue(FILE* fh) {
-	char value[4];
+// With --trace, timed spans from every thread are kept in memory and written
+// on exit, as a Chrome trace (load the .json in chrome://tracing) or as CSV.
+// On ANGLE, the driver's own trace events are forwarded in by anglePlatform.cpp.
+enum { TRACE_MAIN, TRACE_LOADER, TRACE_GPU, TRACE_ANGLE };
 
-	for (int i = 0; i < 4; i++) {
-		value[i] = fgetc(fh);
-		if (value[i] == '\n') {
-			value[i] = '\0';
-			break;
-		} else if (!isdigit(value[i])) {
-			fprintf(stderr, "Error: Value must be a digit.\n");
+typedef struct {
+	const char* name;
+	int track;
+	double start;	// Seconds since trace_origin
+	double duration;
+} TraceEvent;
+
+TraceEvent* trace_events;
+int trace_count;
+int trace_capacity;
+int tracing;
+double trace_origin;
+Mutex trace_lock;
+
+// Defined in anglePlatform.cpp
+int installANGLEPlatform();
+void removeANGLEPlatform();
+
+void startTrace() {
+	initMutex(&trace_lock);
+	trace_origin = currentTime();
+	tracing = 1;
+	installANGLEPlatform();
+}
+
+void traceSpan(const char* name, int track, double start, double duration) {
+	if (!tracing) {
+		return;
+	}
+	lockMutex(&trace_lock);
+	if (trace_count == trace_capacity) {
+		trace_capacity = trace_capacity * 2 + 1024;
+		trace_events = realloc(trace_events, sizeof(TraceEvent) * trace_capacity);
+		if (trace_events == NULL) {
+			fprintf(stderr, "Error: Not enough memory for trace.\n");
 			exit(1);
 		}
 	}
+	trace_events[trace_count].name = name;
+	trace_events[trace_count].track = track;
+	trace_events[trace_count].start = start - trace_origin;
+	trace_events[trace_count].duration = duration;
+	trace_count++;
+	unlockMutex(&trace_lock);
+}
 
-	maxColorValue = atoi(value);
-
-	if (maxColorValue > 255) {
-		fprintf(stderr, "Error: Not a PPM file. Max color value too high.\n");
-		exit(1);
-	} else if (maxColorValue < 1) {
-		fprintf(stderr, "Error: Not a PPM file. Max color value too low.\n");
-		exit(1);
+// Records the span from start, a currentTime() taken before the work, to now.
+void traceEnd(const char* name, int track, double start) {
+	if (tracing) {
+		traceSpan(name, track, start, currentTime() - start);
 	}
 }
 
-void getP3Value(FILE* fh, unsigned char* outValue) {
-	unsigned char value[4];
-	int rgbValue;
+// Writes a span name, which may come from ANGLE, as a JSON string or a CSV
+// field.
+void writeTraceName(FILE* fh, const char* name, int csv) {
+	if (csv) {
+		if (strpbrk(name, ",\"\r\n") == NULL) {
+			fputs(name, fh);
+			return;
+		}
+		fputc('"', fh);
+		for (const char* c = name; *c != '\0'; c++) {
+			if (*c == '"') {
+				fputc('"', fh);
+			}
+			fputc(*c, fh);
+		}
+		fputc('"', fh);
+		return;
+	}
 
-	for (int i = 0; i < 4; i++) {
-		value[i] = fgetc(fh);
-		if (value[i] == '\n') {
-			value[i] = '\0';
-			break;
-		} else if (!isdigit(value[i])) {
-			fprintf(stderr, "Error: Value must be a digit.\n");
-			exit(1);
+	fputc('"', fh);
+	for (const unsigned char* c = (const unsigned char*)name; *c != '\0'; c++) {
+		if (*c == '"' || *c == '\\') {
+			fprintf(fh, "\\%c", *c);
+		} else if (*c < 0x20) {
+			fprintf(fh, "\\u%04x", *c);
+		} else {
+			fputc(*c, fh);
 		}
 	}
+	fputc('"', fh);
+}
 
-	rgbValue = atoi(value);
-	if (rgbValue > maxColorValue) {
-		fprintf(stderr, "Error: Color value exceeding max.\n");
+void writeTrace(const char* path) {
+	static const char* tracks[] = { "main", "loader", "gpu", "angle" };
+	size_t length = strlen(path);
+	int csv = length > 4 && !strcmp(path + length - 4, ".csv");
+	FILE* fh = fopen(path, "w");
+
+	if (fh == NULL) {
+		fprintf(stderr, "Error: Unable to write trace file.\n");
+		exit(1);
+	}
+	if (csv) {
+		fprintf(fh, "name,track,start_ms,duration_ms\n");
+		for (int i = 0; i < trace_count; i++) {
+			TraceEvent* event = &trace_events[i];
+			writeTraceName(fh, event->name, 1);
+			fprintf(fh, ",%s,%.3f,%.3f\n", tracks[event->track], event->start * 1e3, event->duration * 1e3);
+		}
+	} else {
+		fprintf(fh, "{\"traceEvents\":[\n");
+		for (int i = 0; i < 4; i++) {
+			fprintf(fh, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+				i, tracks[i]);
+		}
+		for (int i = 0; i < trace_count; i++) {
+			TraceEvent* event = &trace_events[i];
+			fprintf(fh, "{\"name\":");
+			writeTraceName(fh, event->name, 0);
+			fprintf(fh, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.1f,\"dur\":%.1f}%s\n",
+				event->track, event->start * 1e6, event->duration * 1e6, i + 1 < trace_count ? "," : "");
+		}
+		fprintf(fh, "]}\n");
+	}
+	if (fclose(fh) != 0) {
+		fprintf(stderr, "Error: Unable to write trace file.\n");
 		exit(1);
 	}
+}
 
-	*outValue = rgbValue;
+void finishTrace(const char* path) {
+	removeANGLEPlatform();
+	writeTrace(path);
 }
 
-void parseP3(FILE* fh) {
-	for (int i = 0; i < image_width * image_height * 3; i += 3) {
-		getP3Value(fh, &image[i]);
-		getP3Value(fh, &image[i+1]);
-		getP3Value(fh, &image[i+2]);
-	}
+// With --stats, the window title shows the median and 99th percentile of the
+// last FRAME_STATS_SIZE frame times, and the latest GPU time when known.
+#define FRAME_STATS_SIZE 128
+
+int frame_stats;
+double frame_times[FRAME_STATS_SIZE];
+long frame_time_count;
+double gpu_frame_time;
+
+void recordFrameTime(double seconds) {
+	frame_times[frame_time_count++ % FRAME_STATS_SIZE] = seconds;
 }
 
-void parseP6(FILE* fh) {
-	fread(image, sizeof(unsigned char), image_width * image_height * 3, fh);
+int compareTimes(const void* a, const void* b) {
+	double difference = *(const double*)a - *(const double*)b;
+	return difference < 0 ? -1 : difference > 0;
 }
 
-void loadPPM(FILE* fh) {
-	getWidthAndHeight(fh);
-	image = malloc(sizeof(unsigned char) * image_width * image_height * 3);
-	getMaxColorValue(fh);
-	if (ppmFileType == '3') {
-		parseP3(fh);
-	} else if (ppmFileType == '6') {
-		parseP6(fh);
+void frameTimePercentiles(double* p50, double* p99) {
+	double sorted[FRAME_STATS_SIZE];
+	int count = frame_time_count < FRAME_STATS_SIZE ? (int)frame_time_count : FRAME_STATS_SIZE;
+
+	memcpy(sorted, frame_times, sizeof(double) * count);
+	qsort(sorted, count, sizeof(double), compareTimes);
+	*p50 = count > 0 ? sorted[count / 2] : 0;
+	*p99 = count > 0 ? sorted[count * 99 / 100] : 0;
+}
+
+// Row bands travel from the loader thread to the render thread through a
+// single-producer, single-consumer ring. Each side only writes its own index.
+#define ROW_QUEUE_SIZE 64
+
+typedef struct {
+	int first;
+	int count;
+	unsigned char* pixels;	// The band's samples when streaming, NULL when they are in image.pixels
+} RowBand;
+
+RowBand row_queue[ROW_QUEUE_SIZE];
+volatile long row_queue_head;	// Next band the render thread takes
+volatile long row_queue_tail;	// Next slot the loader fills
+int loading_async;
+volatile long loading_cancelled;
+volatile long window_open;	// The loader wakes the render loop once it is waiting on events
+
+// Called by the decoders as rows become complete, with the buffer holding them
+// when streaming. Returns 0 when the viewer has gone away and decoding should
+// stop.
+int publishBand(int first, int count, unsigned char* pixels) {
+	if (!loading_async) {
+		return 1;
+	}
+
+	long tail = row_queue_tail;
+	while (tail - atomicLoad(&row_queue_head) == ROW_QUEUE_SIZE) {
+		if (atomicLoad(&loading_cancelled)) {
+			return 0;
+		}
+		sleepThread();
 	}
+	row_queue[tail % ROW_QUEUE_SIZE].first = first;
+	row_queue[tail % ROW_QUEUE_SIZE].count = count;
+	row_queue[tail % ROW_QUEUE_SIZE].pixels = pixels;
+	atomicStore(&row_queue_tail, tail + 1);
+	if (atomicLoad(&window_open)) {
+		glfwPostEmptyEvent();
+	}
+	return !atomicLoad(&loading_cancelled);
 }
 
-int main(int argc, char* argv[])
-{
-  FILE* fh;
+int publishRows(int first, int count) {
+	return publishBand(first, count, NULL);
+}
 
-  fh = fopen(argv[1], "rb");
-  if (fh == NULL) {
-    fprintf(stderr, "Error: Input file not found.\n");
-    return 1;
-  }
+int receiveRows(RowBand* band) {
+	long head = row_queue_head;
+	if (head == atomicLoad(&row_queue_tail)) {
+		return 0;
+	}
+	*band = row_queue[head % ROW_QUEUE_SIZE];
+	atomicStore(&row_queue_head, head + 1);
+	return 1;
+}
 
-  getPPMFileType(fh);
+// With --progressive, a mapped P6 file is first sampled at every 16th row and
+// column, then at every 4th, and only then loaded in full. Each preview is
+// shown behind the tiles, replacing the one before, until they cover the image.
+#define PREVIEW_COUNT 2
 
-  loadPPM(fh);
-  fclose(fh);
+typedef struct {
+	unsigned char* pixels;	// RGBA, freed by the render thread once uploaded
+	int width;
+	int height;
+} Preview;
 
-    GLFWwindow* window;
-    GLuint vertex_buffer, vertex_shader, fragment_shader, program;
-    GLint mvp_location, vpos_location, vcol_location;
+const int preview_strides[PREVIEW_COUNT] = { 16, 4 };
+Preview previews[PREVIEW_COUNT];
+volatile long previews_ready;	// Previews the loader has finished, coarsest first
+int progressive_loading;	// Set by --progressive where the file can be sampled
 
-    glfwSetErrorCallback(error_callback);
+// With --stream, the image is never held in full. The loader decodes it a band
+// at a time into a small pool of buffers, which the render thread uploads
+// straight into the tiles and hands back in order.
+#define STREAM_BUFFER_COUNT 4
 
-    if (!glfwInit())
-        exit(EXIT_FAILURE);
+int streaming;	// Set by --stream for the image loaded behind the window
+unsigned char* stream_buffers[STREAM_BUFFER_COUNT];
+volatile long stream_bands_released;	// Bands the render thread has finished with
 
-    glfwDefaultWindowHints();
-    glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+// Waits until the render thread has finished with the first count bands.
+// Returns 0 when loading was cancelled first.
+int waitForStreamBands(long count) {
+	while (atomicLoad(&stream_bands_released) < count) {
+		if (atomicLoad(&loading_cancelled)) {
+			return 0;
+		}
+		sleepThread();
+	}
+	return 1;
+}
 
-    int windowWidth = 640;
-    int windowHeight = 480;
+void freePreviews() {
+	for (int i = 0; i < PREVIEW_COUNT; i++) {
+		free(previews[i].pixels);
+		previews[i].pixels = NULL;
+	}
+}
 
-    const float x = image_width / (float)windowWidth;
-    const float y = image_height / (float)windowHeight;
+// Maps a regular file read-only. Returns 0 for pipes, terminals and anything
+// else that cannot be mapped so the caller can fall back to reading it.
+int mapPPMFile(FILE* fh, PPMImage* ppm) {
+#ifdef _WIN32
+	HANDLE file = (HANDLE)_get_osfhandle(_fileno(fh));
+	LARGE_INTEGER size;
+	// Files larger than the address space are read instead
+	if (GetFileType(file) != FILE_TYPE_DISK || !GetFileSizeEx(file, &size) || size.QuadPart == 0 ||
+	    (unsigned long long)size.QuadPart > SIZE_MAX) {
+		return 0;
+	}
+	HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL) {
+		return 0;
+	}
+	ppm->mapping = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (ppm->mapping == NULL) {
+		return 0;
+	}
+	ppm->mappingSize = (size_t)size.QuadPart;
+#else
+	struct stat st;
+	if (fstat(fileno(fh), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+	    (unsigned long long)st.st_size > SIZE_MAX) {
+		return 0;
+	}
+	void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fh), 0);
+	if (mapping == MAP_FAILED) {
+		return 0;
+	}
+	madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+	ppm->mapping = mapping;
+	ppm->mappingSize = st.st_size;
+#endif
+	return 1;
+}
 
-    vertexes[0].Position[0] = x;
-    vertexes[0].Position[1] = -y;
-    vertexes[1].Position[0] = x;
-    vertexes[1].Position[1] = y;
-    vertexes[2].Position[0] = -x;
-    vertexes[2].Position[1] = y;
-    vertexes[3].Position[0] = -x;
-    vertexes[3].Position[1] = -y;
-    vertexes[4].Position[0] = x;
-    vertexes[4].Position[1] = -y;
+void unmapPPMFile(PPMImage* ppm) {
+#ifdef _WIN32
+	UnmapViewOfFile(ppm->mapping);
+#else
+	munmap(ppm->mapping, ppm->mappingSize);
+#endif
+	ppm->mapping = NULL;
+}
 
-    window = glfwCreateWindow(windowWidth, windowHeight, "ezview", NULL, NULL);
-    if (!window)
-    {
-        glfwTerminate();
-        exit(EXIT_FAILURE);
-    }
+int isPPMSpace(unsigned char c) {
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
 
-    glfwSetKeyCallback(window, key_callback);
+// Skips whitespace and comments, which run from # to the end of the line.
+// Returns NULL when the block ends first.
+const unsigned char* skipPPMSpace(const unsigned char* p, const unsigned char* end) {
+	while (p < end) {
+		if (*p == '#') {
+			while (p < end && *p != '\n' && *p != '\r') {
+				p++;
+			}
+		} else if (isPPMSpace(*p)) {
+			p++;
+		} else {
+			return p;
+		}
+	}
+	return NULL;
+}
 
-    glfwMakeContextCurrent(window);
-    // gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-    glfwSwapInterval(1);
+// Reads the decimal header field at p. Returns the position after it, or NULL
+// when the block ends inside it.
+const unsigned char* readPPMField(const unsigned char* p, const unsigned char* end, const char* name, int* field) {
+	int value = 0;
 
-    // NOTE: OpenGL error checks have been omitted for brevity
+	if (!isdigit(*p)) {
+		fprintf(stderr, "Error: Image %s is not valid.\n", name);
+		exit(1);
+	}
+	while (p < end && isdigit(*p)) {
+		int digit = *p - '0';
+		if (value > (INT_MAX - digit) / 10) {
+			fprintf(stderr, "Error: Image %s is too large.\n", name);
+			exit(1);
+		}
+		value = value * 10 + digit;
+		p++;
+	}
+	if (p == end) {
+		return NULL;
+	}
+	if (!isPPMSpace(*p) && *p != '#') {
+		fprintf(stderr, "Error: Image %s is not valid.\n", name);
+		exit(1);
+	}
+	*field = value;
+	return p;
+}
 
-    glGenBuffers(1, &vertex_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertexes), vertexes, GL_STATIC_DRAW);
+// Parses the header at the start of [start, end): the magic number, width,
+// height and max color value separated by any whitespace and comments, then
+// the single whitespace character before the raster. Returns the offset of
+// the raster, or 0 when the block ends before the header does.
+size_t parsePPMHeader(const unsigned char* start, const unsigned char* end, PPMImage* ppm) {
+	const char* names[3] = { "width", "height", "max color value" };
+	int* fields[3] = { &ppm->width, &ppm->height, &ppm->maxColorValue };
+	const unsigned char* p = start;
 
-    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertex_shader, 1, &vertex_shader_text, NULL);
-    glCompileShaderOrDie(vertex_shader);
+	if (end - p < 3) {
+		return 0;
+	}
+	if (p[0] != 'P' || (p[1] != '3' && p[1] != '6') || (!isPPMSpace(p[2]) && p[2] != '#')) {
+		fprintf(stderr, "Error: Not a PPM file. Incompatible file type.\n");
+		exit(1);
+	}
+	ppm->type = p[1];
+	p += 2;
 
-    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment_shader, 1, &fragment_shader_text, NULL);
-    glCompileShaderOrDie(fragment_shader);
+	for (int i = 0; i < 3; i++) {
+		if ((p = skipPPMSpace(p, end)) == NULL || (p = readPPMField(p, end, names[i], fields[i])) == NULL) {
+			return 0;
+		}
+	}
+	if (*p == '#') {	// The newline ending a comment here ends the header
+		while (p < end && *p != '\n' && *p != '\r') {
+			p++;
+		}
+		if (p == end) {
+			return 0;
+		}
+	}
 
-    program = glCreateProgram();
-    glAttachShader(program, vertex_shader);
-    glAttachShader(program, fragment_shader);
-    glLinkProgram(program);
-    // more error checking! glLinkProgramOrDie!
+	if (ppm->width < 1) {
+		fprintf(stderr, "Error: Image width is not valid.\n");
+		exit(1);
+	} else if (ppm->height < 1) {
+		fprintf(stderr, "Error: Image height is not valid.\n");
+		exit(1);
+	} else if (ppm->maxColorValue > 65535) {
+		fprintf(stderr, "Error: Not a PPM file. Max color value too high.\n");
+		exit(1);
+	} else if (ppm->maxColorValue < 1) {
+		fprintf(stderr, "Error: Not a PPM file. Max color value too low.\n");
+		exit(1);
+	}
+	ppm->sampleBytes = ppm->maxColorValue > 255 ? 2 : 1;
+	return p + 1 - start;
+}
 
-    mvp_location = glGetUniformLocation(program, "MVP");
-    assert(mvp_location != -1);
+// Reads the header of a stream that cannot be mapped, taking no bytes past it
+// so the raster can be read straight after.
+void readPPMHeader(FILE* fh, PPMImage* ppm) {
+	unsigned char* header = NULL;
+	size_t capacity = 0;
+	size_t length = 0;
 
-    vpos_location = glGetAttribLocation(program, "vPos");
-    assert(vpos_location != -1);
+	for (;;) {
+		int c = fgetc(fh);
+		if (c == EOF) {
+			fprintf(stderr, "Error: Not a PPM file. Header is truncated.\n");
+			exit(1);
+		}
+		if (length == capacity) {
+			capacity = capacity > 0 ? capacity * 2 : 256;
+			header = realloc(header, capacity);
+			if (header == NULL) {
+				fprintf(stderr, "Error: Not enough memory for image.\n");
+				exit(1);
+			}
+		}
+		header[length++] = (unsigned char)c;
 
-    GLint texcoord_location = glGetAttribLocation(program, "TexCoordIn");
-    assert(texcoord_location != -1);
+		// Only whitespace can end the header; the magic number is checked early
+		if ((length == 3 || isPPMSpace(c)) && parsePPMHeader(header, header + length, ppm) != 0) {
+			break;
+		}
+	}
 
-    GLint tex_location = glGetUniformLocation(program, "Texture");
-    assert(tex_location != -1);
+	free(header);
+	ppm->headerSize = length;
+}
 
-    glEnableVertexAttribArray(vpos_location);
-    glVertexAttribPointer(vpos_location,
-			  2,
-			  GL_FLOAT,
-			  GL_FALSE,
-                          sizeof(Vertex),
-			  (void*) 0);
+#ifdef EZVIEW_SSE2
+unsigned lowestBit(unsigned mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
 
-    glEnableVertexAttribArray(texcoord_location);
-    glVertexAttribPointer(texcoord_location,
-			  2,
-			  GL_FLOAT,
-			  GL_FALSE,
-                          sizeof(Vertex),
-			  (void*) (sizeof(float) * 2));
+unsigned countBits(unsigned mask) {
+#ifdef _MSC_VER
+	return __popcnt(mask);
+#else
+	return __builtin_popcount(mask);
+#endif
+}
+
+unsigned highestBit(unsigned mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse(&index, mask);
+	return index;
+#else
+	return 31 - __builtin_clz(mask);
+#endif
+}
 
-    GLuint texID;
-    glGenTextures(1, &texID);
-    glBindTexture(GL_TEXTURE_2D, texID);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+// Bit i is set when byte i of v is an ASCII digit / PPM whitespace.
+unsigned digitMask(__m128i v) {
+	__m128i biased = _mm_xor_si128(_mm_sub_epi8(v, _mm_set1_epi8('0')), _mm_set1_epi8((char)0x80));
+	return _mm_movemask_epi8(_mm_cmplt_epi8(biased, _mm_set1_epi8((char)(0x80 + 10))));
+}
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image_width, image_height, 0, GL_RGB,
-		 GL_UNSIGNED_BYTE, image);
+unsigned spaceMask(__m128i v) {
+	__m128i control = _mm_xor_si128(_mm_sub_epi8(v, _mm_set1_epi8('\t')), _mm_set1_epi8((char)0x80));
+	__m128i blank = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+	return _mm_movemask_epi8(_mm_or_si128(blank, _mm_cmplt_epi8(control, _mm_set1_epi8((char)(0x80 + 5)))));
+}
+#endif
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texID);
-    glUniform1i(tex_location, 0);
+// Converts a run of 1-4 digits without branching on its length. Reads four
+// bytes from digit, so up to three bytes past the run must be readable.
+unsigned convertDigits(const unsigned char* digit, unsigned length) {
+	unsigned shift = (4 - length) * 8;
+	unsigned x;
 
-    while (!glfwWindowShouldClose(window))
-    {
-        int width, height;
-        mat4x4 m, p, mvp;
+	memcpy(&x, digit, 4);
+	x = (x << shift) - (0x30303030u << shift);	// Right-align the digits in the top bytes
+	x = x * 10 + (x >> 8);				// Byte 0: tens/units of the high pair, byte 2: of the low pair
+	return (x & 0xFF) * 100 + ((x >> 16) & 0xFF);
+}
 
-        glfwGetFramebufferSize(window, &width, &height);
+// Stores sample n of out, rescaled to the full 8 or 16 bit range.
+void storeP3Value(unsigned value, const PPMImage* ppm, unsigned char* out, size_t n) {
+	if (value > (unsigned)ppm->maxColorValue) {
+		fprintf(stderr, "Error: Color value exceeding max.\n");
+		exit(1);
+	}
+	if (ppm->scale != NULL) {
+		value = ppm->scale[value];
+	}
+	if (ppm->sampleBytes == 2) {
+		((unsigned short*)out)[n] = (unsigned short)value;
+	} else {
+		out[n] = (unsigned char)value;
+	}
+}
 
-        glViewport(0, 0, width, height);
-        glClear(GL_COLOR_BUFFER_BIT);
+// Decodes up to count samples from [p, end), which must not end in the middle
+// of a sample. Returns the position after the last sample consumed.
+//
+// Only the digit and whitespace classification is vectorised: runs are
+// converted one at a time and storeP3Value checks each sample against
+// maxColorValue with a scalar compare. That per-run work is what holds a
+// single core to about 450-650 MB/s, short of 1 GB/s; --benchmark prints it
+// next to the fgetc parser this replaced.
+const unsigned char* decodeP3(const unsigned char* p, const unsigned char* end, const PPMImage* ppm,
+			      unsigned char* out, size_t count, size_t* decoded) {
+	unsigned maxValue = ppm->maxColorValue;
+	size_t n = 0;
 
-        mat4x4_identity(m);
-        mat4x4_translate(m, trans_x, trans_y, 0);
-        mat4x4_scale_lin(m, m, scale);
-        mat4x4_rotate_Z(m, m, rotation);
-        mat4x4_shear(mvp, m, shear);
+#ifdef EZVIEW_SSE2
+	// Classify 16 bytes at a time and convert every digit run that ends inside
+	// the window. A window holds at most 8 samples, so count is never overrun.
+	while (end - p >= 16 + 3 && count - n >= 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		unsigned digits = digitMask(v);
+		unsigned spaces = spaceMask(v);
+		unsigned width = 16;
 
-        glUseProgram(program);
-        glUniformMatrix4fv(mvp_location, 1, GL_FALSE, (const GLfloat*) mvp);
-        glDrawArrays(GL_TRIANGLES, 0, 3);
-        glDrawArrays(GL_TRIANGLES, 2, 3);
+		if ((digits | spaces) != 0xFFFF) {
+			break;	// Let the scalar loop report the bad character
+		}
+		if (digits & 0x8000) {
+			// The last run may continue past the window; leave it for the next one
+			if (spaces == 0) {
+				break;
+			}
+			width = highestBit(spaces) + 1;
+			digits &= (1u << width) - 1;
+		}
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
-    }
+		while (digits) {
+			unsigned start = lowestBit(digits);
+			unsigned length = lowestBit(~(digits >> start));
+			const unsigned char* digit = p + start;
+			unsigned value;
 
-    glfwDestroyWindow(window);
+			if (length > 5) {
+				p = digit;
+				goto scalar;
+			}
+			if (length == 5) {
+				value = convertDigits(digit, 4) * 10 + (digit[4] - '0');
+			} else {
+				value = convertDigits(digit, length);
+			}
+			storeP3Value(value, ppm, out, n++);
+			digits &= digits + (1u << start);	// Clear the run just converted
+		}
+		p += width;
+	}
+scalar:
+#endif
 
-    glfwTerminate();
+	while (n < count) {
+		while (p < end && isPPMSpace(*p)) {
+			p++;
+		}
+		if (p == end) {
+			break;
+		}
 
-    free(image);
+		unsigned value = 0;
+		const unsigned char* start = p;
+		while (p < end && (unsigned)(*p - '0') < 10) {
+			value = value * 10 + (*p - '0');
+			if (value > maxValue) {
+				fprintf(stderr, "Error: Color value exceeding max.\n");
+				exit(1);
+			}
+			p++;
+		}
+		if (p == start || (p < end && !isPPMSpace(*p))) {
+			fprintf(stderr, "Error: Value must be a digit.\n");
+			exit(1);
+		}
+		storeP3Value(value, ppm, out, n++);
+	}
+
+	*decoded = n;
+	return p;
+}
+
+// Counts the whitespace-separated samples in [p, end) without converting them.
+size_t countP3Samples(const unsigned char* p, const unsigned char* end) {
+	size_t samples = 0;
+	unsigned inSample = 0;
+
+#ifdef EZVIEW_SSE2
+	while (end - p >= 16) {
+		unsigned sample = ~spaceMask(_mm_loadu_si128((const __m128i*)p)) & 0xFFFF;
+		samples += countBits(sample & ~((sample << 1) | inSample));
+		inSample = sample >> 15;
+		p += 16;
+	}
+#endif
+	for (; p < end; p++) {
+		unsigned sample = !isPPMSpace(*p);
+		samples += sample & !inSample;
+		inSample = sample;
+	}
+	return samples;
+}
+
+// P3 samples vary in width, so reaching a row means scanning every row before
+// it. The first full decode of a large P3 file opened for viewing notes where
+// every P3_INDEX_ROWS-th row starts and saves that beside the file, as
+// image.ppm.ezindex, keyed by the file's size and modification time. Later
+// decodes split the work at indexed rows, and crops start at the nearest one.
+// Batch and flipbook inputs leave path unset, so they never write an index.
+#define P3_INDEX_ROWS 16
+#define P3_INDEX_MIN_BYTES (16 << 20)	// Smaller rasters decode too quickly to be worth indexing
+#define P3_INDEX_MAGIC 0x49525A45	// "EZRI"
+
+typedef struct {
+	unsigned magic;	// Reads differently on a machine of the other byte order
+	unsigned rows;
+	long long fileSize;
+	long long modified;
+	long long headerSize;
+	int width, height, maxColorValue;
+	int entries;
+} RowIndexHeader;
+
+int rowIndexEntries(const PPMImage* ppm) {
+	return (ppm->height - 1) / P3_INDEX_ROWS + 1;
+}
+
+// Describes the index ppm needs while the file behind fh is as it is now.
+int stampRowIndex(FILE* fh, const PPMImage* ppm, RowIndexHeader* header) {
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_fstat64(_fileno(fh), &st) != 0) {
+		return 0;
+	}
+#else
+	struct stat st;
+	if (fstat(fileno(fh), &st) != 0) {
+		return 0;
+	}
+#endif
+	memset(header, 0, sizeof(*header));
+	header->magic = P3_INDEX_MAGIC;
+	header->rows = P3_INDEX_ROWS;
+	header->fileSize = st.st_size;
+	header->modified = st.st_mtime;
+	header->headerSize = ppm->headerSize;
+	header->width = ppm->width;
+	header->height = ppm->height;
+	header->maxColorValue = ppm->maxColorValue;
+	header->entries = rowIndexEntries(ppm);
+	return 1;
+}
+
+char* rowIndexPath(const PPMImage* ppm) {
+	char* path = malloc(strlen(ppm->path) + sizeof(".ezindex"));
+	if (path != NULL) {
+		sprintf(path, "%s.ezindex", ppm->path);
+	}
+	return path;
+}
+
+// Loads the index beside ppm's file when there is one that still matches it.
+void loadRowIndex(FILE* fh, PPMImage* ppm) {
+	RowIndexHeader expected, header;
+	char* path;
+	FILE* index;
+	int valid;
+
+	if (ppm->path == NULL || !stampRowIndex(fh, ppm, &expected) || (path = rowIndexPath(ppm)) == NULL) {
+		return;
+	}
+	index = fopen(path, "rb");
+	free(path);
+	if (index == NULL) {
+		return;
+	}
+
+	ppm->rowOffsets = malloc(sizeof(long long) * expected.entries);
+	valid = ppm->rowOffsets != NULL && fread(&header, sizeof(header), 1, index) == 1 &&
+		!memcmp(&header, &expected, sizeof(header)) &&
+		fread(ppm->rowOffsets, sizeof(long long), expected.entries, index) == (size_t)expected.entries;
+	// Offsets are trusted to stay inside the mapping, so check them
+	for (int i = 0; valid && i < expected.entries; i++) {
+		long long previous = i > 0 ? ppm->rowOffsets[i - 1] : expected.headerSize;
+		valid = ppm->rowOffsets[i] >= previous && ppm->rowOffsets[i] <= expected.fileSize;
+	}
+	fclose(index);
+
+	if (valid) {
+		ppm->rowIndexLoaded = 1;
+	} else {
+		free(ppm->rowOffsets);
+		ppm->rowOffsets = NULL;
+	}
+}
+
+// Writes the index filled in while decoding ppm beside its file. Where that
+// cannot be written, as on read-only media, the index is simply not kept.
+void saveRowIndex(FILE* fh, const PPMImage* ppm) {
+	RowIndexHeader header;
+	char* path;
+	FILE* index;
+
+	if (!stampRowIndex(fh, ppm, &header) || (path = rowIndexPath(ppm)) == NULL) {
+		return;
+	}
+	index = fopen(path, "wb");
+	if (index != NULL) {
+		int written = fwrite(&header, sizeof(header), 1, index) == 1 &&
+			      fwrite(ppm->rowOffsets, sizeof(long long), header.entries, index) == (size_t)header.entries;
+		if (fclose(index) != 0 || !written) {
+			remove(path);
+		}
+	}
+	free(path);
+}
+
+void freeRowIndex(PPMImage* ppm) {
+	free(ppm->rowOffsets);
+	ppm->rowOffsets = NULL;
+	ppm->rowIndexLoaded = 0;
+}
+
+// Decodes count samples of the mapped image, starting at sample first, from
+// p. Notes where each indexed row starts on the way, while the index is being
+// built.
+const unsigned char* decodeP3Indexed(const unsigned char* p, const unsigned char* end, PPMImage* ppm,
+				     size_t first, size_t count, size_t* decoded) {
+	size_t stride = (size_t)ppm->width * 3 * P3_INDEX_ROWS;
+	long long* building = ppm->rowIndexLoaded ? NULL : ppm->rowOffsets;
+	size_t done = 0;
+
+	while (done < count) {
+		size_t sample = first + done;
+		size_t next = building != NULL ? (sample / stride + 1) * stride : first + count;
+		size_t wanted = (next < first + count ? next : first + count) - sample;
+		size_t n;
+
+		if (building != NULL && sample % stride == 0) {
+			building[sample / stride] = p - ppm->mapping;
+		}
+		p = decodeP3(p, end, ppm, ppm->pixels + sample * ppm->sampleBytes, wanted, &n);
+		done += n;
+		if (n < wanted) {
+			break;
+		}
+	}
+	*decoded = done;
+	return p;
+}
+
+typedef struct {
+	const unsigned char* start;
+	const unsigned char* end;
+	size_t samples;
+	size_t offset;
+	size_t decoded;
+	PPMImage* ppm;
+} P3Chunk;
+
+void countP3Chunk(void* context, int index) {
+	P3Chunk* chunk = (P3Chunk*)context + index;
+	chunk->samples = atomicLoad(&loading_cancelled) ? 0 : countP3Samples(chunk->start, chunk->end);
+}
+
+#define P3_CANCEL_SAMPLES (1 << 20)	// Samples decoded between checks for cancellation
+
+// Decodes a chunk a block of samples at a time, so that closing the window
+// stops every worker promptly.
+void decodeP3Chunk(void* context, int index) {
+	P3Chunk* chunk = (P3Chunk*)context + index;
+	PPMImage* ppm = chunk->ppm;
+	size_t size = imageSize(ppm) / ppm->sampleBytes;
+	const unsigned char* p = chunk->start;
+	size_t offset = chunk->offset;
+
+	chunk->decoded = 0;
+	while (offset < size && !atomicLoad(&loading_cancelled)) {
+		size_t wanted = size - offset < P3_CANCEL_SAMPLES ? size - offset : P3_CANCEL_SAMPLES;
+		size_t n;
+
+		p = decodeP3Indexed(p, chunk->end, ppm, offset, wanted, &n);
+		chunk->decoded += n;
+		offset += n;
+		if (n < wanted) {
+			break;
+		}
+	}
+}
+
+#define P3_PARALLEL_MIN_CHUNK (4 << 20)
+
+// Splits the payload into chunks and decodes them concurrently. With a row
+// index, chunks start at indexed rows, whose place in the image is known.
+// Otherwise the payload is split at whitespace and the samples in each chunk
+// are counted first to find where its pixels land.
+size_t decodeP3Parallel(const unsigned char* p, const unsigned char* end, PPMImage* ppm) {
+	size_t length = end - p;
+	int chunks = getWorkerThreads() * 4;
+	size_t decoded = 0;
+
+	if (length / chunks < P3_PARALLEL_MIN_CHUNK) {
+		chunks = (int)(length / P3_PARALLEL_MIN_CHUNK) + 1;
+	}
+
+	int entries = rowIndexEntries(ppm);
+	int entriesPerChunk = (entries - 1) / chunks + 1;
+	if (ppm->rowIndexLoaded) {
+		chunks = (entries - 1) / entriesPerChunk + 1;
+	}
+
+	P3Chunk* chunk = malloc(sizeof(P3Chunk) * chunks);
+	if (chunk == NULL) {
+		fprintf(stderr, "Error: Not enough memory for image.\n");
+		exit(1);
+	}
+
+	if (ppm->rowIndexLoaded) {
+		for (int i = 0; i < chunks; i++) {
+			int first = i * entriesPerChunk;
+			int last = first + entriesPerChunk;
+
+			chunk[i].start = ppm->mapping + ppm->rowOffsets[first];
+			chunk[i].end = last < entries ? ppm->mapping + ppm->rowOffsets[last] : end;
+			chunk[i].offset = (size_t)first * ppm->width * 3 * P3_INDEX_ROWS;
+			chunk[i].ppm = ppm;
+		}
+	} else {
+		for (int i = 0; i < chunks; i++) {
+			const unsigned char* split = p + length / chunks * (i + 1);
+			if (i == chunks - 1) {
+				split = end;
+			}
+			while (split < end && !isPPMSpace(*split)) {
+				split++;
+			}
+			chunk[i].start = i == 0 ? p : chunk[i - 1].end;
+			chunk[i].end = split < chunk[i].start ? chunk[i].start : split;
+			chunk[i].ppm = ppm;
+		}
+
+		parallelFor(chunks, countP3Chunk, chunk);
+		for (int i = 0; i < chunks; i++) {
+			chunk[i].offset = decoded;
+			decoded += chunk[i].samples;
+		}
+		decoded = 0;
+	}
+	parallelFor(chunks, decodeP3Chunk, chunk);
+
+	for (int i = 0; i < chunks; i++) {
+		decoded += chunk[i].decoded;
+	}
+	free(chunk);
+	return decoded;
+}
+
+#define P3_CHUNK_SIZE (1 << 20)
+
+// Number of rows decoded between reports to the render thread, about 1 MiB
+int rowsPerBand(PPMImage* ppm) {
+	size_t rows = (1 << 20) / ((size_t)ppm->width * 3 * ppm->sampleBytes);
+	return rows > 0 ? (int)rows : 1;
+}
+
+void parseP3(FILE* fh, PPMImage* ppm) {
+	size_t rowSize = (size_t)ppm->width * 3;
+	size_t size = imageSize(ppm) / ppm->sampleBytes;	// In samples
+	size_t decoded = 0;
+
+	ppm->pixels = malloc(imageSize(ppm));
+	if (ppm->pixels == NULL) {
+		fprintf(stderr, "Error: Not enough memory for image.\n");
+		exit(1);
+	}
+
+	if (ppm->mapping != NULL) {
+		const unsigned char* payload = ppm->mapping + ppm->headerSize;
+		const unsigned char* end = ppm->mapping + ppm->mappingSize;
+
+		// Large files that can be opened again get a row index
+		if (ppm->rowOffsets == NULL && ppm->path != NULL && (size_t)(end - payload) >= P3_INDEX_MIN_BYTES) {
+			ppm->rowOffsets = malloc(sizeof(long long) * rowIndexEntries(ppm));
+		}
+
+		if (!ppm->singleThreaded && getWorkerThreads() > 1 && (size_t)(end - payload) >= 2 * P3_PARALLEL_MIN_CHUNK) {
+			decoded = decodeP3Parallel(payload, end, ppm);
+			if (decoded >= size) {
+				publishRows(0, ppm->height);
+			}
+		} else {
+			int band = rowsPerBand(ppm);
+			for (int row = 0; row < ppm->height; row += band) {
+				int count = ppm->height - row < band ? ppm->height - row : band;
+				size_t n;
+
+				payload = decodeP3Indexed(payload, end, ppm, decoded, rowSize * count, &n);
+				decoded += n;
+				if (n < rowSize * count || !publishRows(row, count)) {
+					break;
+				}
+			}
+		}
+		unmapPPMFile(ppm);
+	} else {
+		// Read in large blocks, decoding up to the last whitespace of each one and
+		// carrying the partial sample over to the next.
+		unsigned char* buffer = malloc(P3_CHUNK_SIZE);
+		size_t held = 0;
+		int done = 0;
+		int published = 0;
+
+		if (buffer == NULL) {
+			fprintf(stderr, "Error: Not enough memory for image.\n");
+			exit(1);
+		}
+		while (!done && decoded < size) {
+			size_t wanted = P3_CHUNK_SIZE - held;
+			size_t got = fread(buffer + held, 1, wanted, fh);
+			size_t usable, n;
+
+			held += got;
+			done = got < wanted;
+			usable = held;
+			if (!done) {
+				while (usable > 0 && !isPPMSpace(buffer[usable - 1])) {
+					usable--;
+				}
+				if (usable == 0) {
+					fprintf(stderr, "Error: Value must be a digit.\n");
+					exit(1);
+				}
+			}
+			decodeP3(buffer, buffer + usable, ppm, ppm->pixels + decoded * ppm->sampleBytes, size - decoded, &n);
+			decoded += n;
+			memmove(buffer, buffer + usable, held - usable);
+			held -= usable;
+
+			int rows = (int)(decoded / rowSize);
+			if (rows > published) {
+				if (!publishRows(published, rows - published)) {
+					break;
+				}
+				published = rows;
+			}
+		}
+		free(buffer);
+	}
+
+	if (decoded < size && !atomicLoad(&loading_cancelled)) {
+		fprintf(stderr, "Error: Image data is truncated.\n");
+		exit(1);
+	}
+}
+
+// Copies count samples from src to dst, rescaling them to the full 8 or 16 bit
+// range, and checks them against maxColorValue. 16 bit samples are stored big
+// endian in the file and in host order in dst. src and dst may be the same.
+void normalizeP6(const unsigned char* src, size_t count, const PPMImage* ppm, unsigned char* dst) {
+	const unsigned short* table = ppm->scale;
+	unsigned maxValue = ppm->maxColorValue;
+	unsigned largest = 0;
+	size_t i = 0;
+
+	if (ppm->sampleBytes == 1) {
+#ifdef EZVIEW_SSE2
+		// The table covers every byte, so the check can wait for the whole run
+		__m128i most = _mm_setzero_si128();
+		for (; i + 16 <= count; i += 16) {
+			most = _mm_max_epu8(most, _mm_loadu_si128((const __m128i*)(src + i)));
+			for (int j = 0; j < 16; j++) {
+				dst[i + j] = (unsigned char)table[src[i + j]];
+			}
+		}
+		most = _mm_max_epu8(most, _mm_srli_si128(most, 8));
+		most = _mm_max_epu8(most, _mm_srli_si128(most, 4));
+		most = _mm_max_epu8(most, _mm_srli_si128(most, 2));
+		most = _mm_max_epu8(most, _mm_srli_si128(most, 1));
+		largest = _mm_cvtsi128_si32(most) & 0xFF;
+#endif
+		for (; i < count; i++) {
+			largest = src[i] > largest ? src[i] : largest;
+			dst[i] = (unsigned char)table[src[i]];
+		}
+	} else {
+		unsigned short* out = (unsigned short*)dst;
+
+#ifdef EZVIEW_SSE2
+		// Full range samples only need their bytes swapped
+		for (; table == NULL && i + 8 <= count; i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i * 2));
+			_mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+		}
+#endif
+		for (; i < count; i++) {
+			unsigned value = src[i * 2] << 8 | src[i * 2 + 1];
+			largest = value > largest ? value : largest;
+			out[i] = table != NULL ? table[value] : (unsigned short)value;
+		}
+	}
+
+	if (largest > maxValue) {
+		fprintf(stderr, "Error: Color value exceeding max.\n");
+		exit(1);
+	}
+}
+
+// Reads a byte of every page in a mapped range, so it is resident before
+// another thread needs it.
+void touchPages(const unsigned char* p, size_t size) {
+	volatile unsigned char sink;
+
+	for (size_t i = 0; i < size; i += 4096) {
+		sink = p[i];
+	}
+	(void)sink;
+}
+
+void parseP6(FILE* fh, PPMImage* ppm) {
+	size_t rowSize = (size_t)ppm->width * 3 * ppm->sampleBytes;
+	size_t size = imageSize(ppm);
+	int normalized = ppm->sampleBytes == 2 || ppm->scale != NULL;
+	int band = rowsPerBand(ppm);
+
+	if (ppm->mapping != NULL && ppm->mappingSize - ppm->headerSize < size) {
+		fprintf(stderr, "Error: Image data is truncated.\n");
+		exit(1);
+	}
+
+	// Full range 8 bit rasters are used in place when the file is mapped; the
+	// texture upload reads straight out of the page cache.
+	if (ppm->mapping != NULL && !normalized) {
+		ppm->pixels = ppm->mapping + ppm->headerSize;
+		if (!progressive_loading || !loading_async) {
+			publishRows(0, ppm->height);
+			return;
+		}
+
+		// Progressive loads page the raster in ahead of the render thread
+		// instead, so it never waits on the disk while a preview is up
+		for (int row = 0; row < ppm->height; row += band) {
+			int count = ppm->height - row < band ? ppm->height - row : band;
+
+			touchPages(ppm->pixels + rowSize * row, rowSize * count);
+			if (!publishRows(row, count)) {
+				break;
+			}
+		}
+		return;
+	}
+
+	ppm->pixels = malloc(size);
+	if (ppm->pixels == NULL) {
+		fprintf(stderr, "Error: Not enough memory for image.\n");
+		exit(1);
+	}
+
+	// Anything else is normalized a band at a time, straight out of the mapping
+	// or in place after reading
+	for (int row = 0; row < ppm->height; row += band) {
+		int count = ppm->height - row < band ? ppm->height - row : band;
+		unsigned char* out = ppm->pixels + rowSize * row;
+
+		if (ppm->mapping != NULL) {
+			normalizeP6(ppm->mapping + ppm->headerSize + rowSize * row, rowSize / ppm->sampleBytes * count, ppm, out);
+		} else {
+			if (fread(out, 1, rowSize * count, fh) != rowSize * count) {
+				fprintf(stderr, "Error: Image data is truncated.\n");
+				exit(1);
+			}
+			if (normalized) {
+				normalizeP6(out, rowSize / ppm->sampleBytes * count, ppm, out);
+			}
+		}
+		if (!publishRows(row, count)) {
+			break;
+		}
+	}
+	if (ppm->mapping != NULL) {
+		unmapPPMFile(ppm);
+	}
+}
+
+// Regular files are mapped and their header parsed in place; the raster is
+// then decoded from the same mapping. Anything else is read as a stream.
+void loadPPMHeader(FILE* fh, PPMImage* ppm) {
+	if (fileOffset(fh) == 0 && mapPPMFile(fh, ppm)) {
+		ppm->headerSize = parsePPMHeader(ppm->mapping, ppm->mapping + ppm->mappingSize, ppm);
+		if (ppm->headerSize == 0) {
+			fprintf(stderr, "Error: Not a PPM file. Header is truncated.\n");
+			exit(1);
+		}
+	} else {
+		readPPMHeader(fh, ppm);
+	}
+}
+
+// Builds the table rescaling samples so that maxColorValue becomes 255, or
+// 65535 for 16 bit images. It covers every value a sample can hold, so lookups
+// can run ahead of the check against maxColorValue.
+void createScaleTable(PPMImage* ppm) {
+	unsigned full = ppm->sampleBytes == 2 ? 65535 : 255;
+	unsigned maxValue = ppm->maxColorValue;
+
+	ppm->scale = NULL;
+	if (maxValue == full) {
+		return;
+	}
+	ppm->scale = malloc(sizeof(unsigned short) * (full + 1));
+	if (ppm->scale == NULL) {
+		fprintf(stderr, "Error: Not enough memory for image.\n");
+		exit(1);
+	}
+	for (unsigned value = 0; value <= full; value++) {
+		ppm->scale[value] = value <= maxValue ? (unsigned short)((value * full + maxValue / 2) / maxValue) : 0;
+	}
+}
+
+void loadPPMData(FILE* fh, PPMImage* ppm) {
+	createScaleTable(ppm);
+	if (ppm->type == '3') {
+		if (ppm->mapping != NULL) {
+			loadRowIndex(fh, ppm);
+		}
+		parseP3(fh, ppm);
+		if (ppm->rowOffsets != NULL && !ppm->rowIndexLoaded && !atomicLoad(&loading_cancelled)) {
+			saveRowIndex(fh, ppm);
+		}
+		freeRowIndex(ppm);
+	} else if (ppm->type == '6') {
+		parseP6(fh, ppm);
+	}
+	free(ppm->scale);
+	ppm->scale = NULL;
+}
+
+void loadPPM(FILE* fh, PPMImage* ppm) {
+	loadPPMHeader(fh, ppm);
+	loadPPMData(fh, ppm);
+}
+
+void freeImage(PPMImage* ppm) {
+	if (ppm->mapping != NULL) {
+		unmapPPMFile(ppm);
+	} else {
+		free(ppm->pixels);
+	}
+	ppm->pixels = NULL;
+}
+
+typedef struct {
+	FILE* fh;
+	PPMImage* ppm;
+	unsigned char* pixels;
+	int x, y, width, height;
+	int band;	// Rows read by each job
+} RegionJob;
+
+// Reads a band of the region's rows straight from their place in the file.
+void readRegionBand(void* context, int index) {
+	RegionJob* job = context;
+	PPMImage* ppm = job->ppm;
+	size_t fileRowBytes = (size_t)ppm->width * 3 * ppm->sampleBytes;
+	size_t rowBytes = (size_t)job->width * 3 * ppm->sampleBytes;
+	int first = index * job->band;
+	int count = job->height - first < job->band ? job->height - first : job->band;
+	long long offset = (long long)ppm->headerSize + (long long)fileRowBytes * (job->y + first) +
+			   (long long)job->x * 3 * ppm->sampleBytes;
+	unsigned char* out = job->pixels + rowBytes * first;
+
+	// Whole rows are contiguous in the file, so the band is one read
+	int rowsPerRead = rowBytes == fileRowBytes ? count : 1;
+	for (int row = 0; row < count; row += rowsPerRead) {
+		if (!readFileAt(job->fh, out + rowBytes * row, rowBytes * rowsPerRead,
+				offset + (long long)fileRowBytes * row)) {
+			fprintf(stderr, "Error: Image data is truncated.\n");
+			exit(1);
+		}
+	}
+	if (ppm->sampleBytes == 2 || ppm->scale != NULL) {
+		normalizeP6(out, rowBytes / ppm->sampleBytes * count, ppm, out);
+	}
+}
+
+// Decodes the group of rows after one entry of a P3 row index, keeping the
+// region's share of them.
+void decodeRegionGroup(void* context, int index) {
+	RegionJob* job = context;
+	PPMImage* ppm = job->ppm;
+	int entry = job->y / P3_INDEX_ROWS + index;
+	int first = entry * P3_INDEX_ROWS;
+	int top = first > job->y ? first : job->y;
+	int bottom = first + P3_INDEX_ROWS < job->y + job->height ? first + P3_INDEX_ROWS : job->y + job->height;
+	size_t texelBytes = (size_t)3 * ppm->sampleBytes;
+	size_t samples = (size_t)ppm->width * 3 * (bottom - first);
+	unsigned char* rows = malloc(samples * ppm->sampleBytes);
+	size_t decoded;
+
+	if (rows == NULL) {
+		fprintf(stderr, "Error: Not enough memory for image.\n");
+		exit(1);
+	}
+	decodeP3(ppm->mapping + ppm->rowOffsets[entry], ppm->mapping + ppm->mappingSize, ppm, rows, samples, &decoded);
+	if (decoded < samples) {
+		fprintf(stderr, "Error: Image data is truncated.\n");
+		exit(1);
+	}
+	for (int row = top; row < bottom; row++) {
+		memcpy(job->pixels + (size_t)(row - job->y) * job->width * texelBytes,
+		       rows + ((size_t)(row - first) * ppm->width + job->x) * texelBytes, job->width * texelBytes);
+	}
+	free(rows);
+}
+
+// Decodes only the given region of the image whose header has been read,
+// leaving ppm as that region. P6 rows are a fixed size, so the rows of a
+// seekable file are read in place, concurrently, and nothing else is touched.
+// P3 files with a row index decode only the indexed groups of rows the region
+// covers, also concurrently. Other P3 files and pipes are decoded in full,
+// which indexes a large file for next time, then cut down. Only --crop reads
+// regions; the tiles are always uploaded from a whole image.
+void loadPPMRegion(FILE* fh, PPMImage* ppm, int x, int y, int width, int height) {
+	if (x > ppm->width - width || y > ppm->height - height) {
+		fprintf(stderr, "Error: Crop region is outside the image.\n");
+		exit(1);
+	}
+	if (ppm->type == '3' && ppm->mapping != NULL) {
+		loadRowIndex(fh, ppm);
+	}
+
+	if (ppm->rowIndexLoaded) {
+		RegionJob job = { fh, ppm, NULL, x, y, width, height, P3_INDEX_ROWS };
+
+		job.pixels = malloc(checkedMultiply((size_t)width * 3 * ppm->sampleBytes, height));
+		if (job.pixels == NULL) {
+			fprintf(stderr, "Error: Not enough memory for image.\n");
+			exit(1);
+		}
+		createScaleTable(ppm);
+		parallelFor((y + height - 1) / P3_INDEX_ROWS - y / P3_INDEX_ROWS + 1, decodeRegionGroup, &job);
+		free(ppm->scale);
+		ppm->scale = NULL;
+		freeRowIndex(ppm);
+		unmapPPMFile(ppm);
+		ppm->pixels = job.pixels;
+	} else if (ppm->type == '6' && fileOffset(fh) >= 0) {
+		RegionJob job = { fh, ppm, NULL, x, y, width, height, 0 };
+		size_t rowBytes = (size_t)width * 3 * ppm->sampleBytes;
+
+		if (ppm->mapping != NULL) {
+			unmapPPMFile(ppm);
+		}
+		job.pixels = malloc(checkedMultiply(rowBytes, height));
+		if (job.pixels == NULL) {
+			fprintf(stderr, "Error: Not enough memory for image.\n");
+			exit(1);
+		}
+		job.band = (int)((1 << 20) / rowBytes) + 1;
+		createScaleTable(ppm);
+		parallelFor((height - 1) / job.band + 1, readRegionBand, &job);
+		free(ppm->scale);
+		ppm->scale = NULL;
+		ppm->pixels = job.pixels;
+	} else {
+		PPMImage full = *ppm;
+		size_t texelBytes = (size_t)3 * ppm->sampleBytes;
+
+		loadPPMData(fh, &full);
+		ppm->pixels = malloc(checkedMultiply((size_t)width * texelBytes, height));
+		if (ppm->pixels == NULL) {
+			fprintf(stderr, "Error: Not enough memory for image.\n");
+			exit(1);
+		}
+		for (int row = 0; row < height; row++) {
+			memcpy(ppm->pixels + (size_t)row * width * texelBytes,
+			       full.pixels + ((size_t)(y + row) * full.width + x) * texelBytes, width * texelBytes);
+		}
+		freeImage(&full);
+		ppm->mapping = NULL;
+	}
+	ppm->width = width;
+	ppm->height = height;
+}
+
+// Decodes the whole raster a band at a time into stream_buffers, handing each
+// band to the render thread and reusing its buffer once it comes back. Mapped
+// files are read instead, so their pages do not pile up in the process either.
+// P3 is decoded on this thread alone.
+void streamPPMData(FILE* fh, PPMImage* ppm) {
+	size_t rowSamples = (size_t)ppm->width * 3;
+	int band = rowsPerBand(ppm);
+	unsigned char* input = ppm->type == '3' ? malloc(P3_CHUNK_SIZE) : NULL;
+	size_t held = 0;
+	int done = 0;
+	long index = 0;
+
+	if (ppm->mapping != NULL) {
+		unmapPPMFile(ppm);
+		if (!seekFile(fh, ppm->headerSize)) {
+			fprintf(stderr, "Error: Unable to read input file.\n");
+			exit(1);
+		}
+	}
+	for (int i = 0; i < STREAM_BUFFER_COUNT; i++) {
+		stream_buffers[i] = malloc(checkedMultiply(rowSamples * ppm->sampleBytes, band));
+		if (stream_buffers[i] == NULL) {
+			fprintf(stderr, "Error: Not enough memory for image.\n");
+			exit(1);
+		}
+	}
+	if (ppm->type == '3' && input == NULL) {
+		fprintf(stderr, "Error: Not enough memory for image.\n");
+		exit(1);
+	}
+	createScaleTable(ppm);
+
+	for (int row = 0; row < ppm->height; row += band, index++) {
+		int count = ppm->height - row < band ? ppm->height - row : band;
+		size_t samples = rowSamples * count;
+		unsigned char* out = stream_buffers[index % STREAM_BUFFER_COUNT];
+
+		if (!waitForStreamBands(index - STREAM_BUFFER_COUNT + 1)) {
+			break;
+		}
+
+		if (ppm->type == '6') {
+			if (fread(out, ppm->sampleBytes, samples, fh) != samples) {
+				fprintf(stderr, "Error: Image data is truncated.\n");
+				exit(1);
+			}
+			if (ppm->sampleBytes == 2 || ppm->scale != NULL) {
+				normalizeP6(out, samples, ppm, out);
+			}
+		} else {
+			// As in parseP3, decode up to the last whitespace read and carry
+			// the partial sample over, stopping at the end of the band
+			for (size_t decoded = 0; decoded < samples; ) {
+				size_t usable, n;
+
+				if (!done && held < P3_CHUNK_SIZE) {
+					size_t wanted = P3_CHUNK_SIZE - held;
+					size_t got = fread(input + held, 1, wanted, fh);
+					held += got;
+					done = got < wanted;
+				}
+				usable = held;
+				if (!done) {
+					while (usable > 0 && !isPPMSpace(input[usable - 1])) {
+						usable--;
+					}
+					if (usable == 0) {
+						fprintf(stderr, "Error: Value must be a digit.\n");
+						exit(1);
+					}
+				}
+
+				const unsigned char* p = decodeP3(input, input + usable, ppm, out + decoded * ppm->sampleBytes,
+								  samples - decoded, &n);
+				if (n == 0 && done) {
+					fprintf(stderr, "Error: Image data is truncated.\n");
+					exit(1);
+				}
+				decoded += n;
+				held -= p - input;
+				memmove(input, p, held);
+			}
+		}
+
+		if (!publishBand(row, count, out)) {
+			break;
+		}
+	}
+
+	// The render thread may still be uploading the last few bands
+	waitForStreamBands(index);
+	for (int i = 0; i < STREAM_BUFFER_COUNT; i++) {
+		free(stream_buffers[i]);
+		stream_buffers[i] = NULL;
+	}
+	free(input);
+	free(ppm->scale);
+	ppm->scale = NULL;
+}
+
+// Rescales a P6 sample to 8 bits for a preview.
+unsigned char previewSample(const unsigned char* p, const PPMImage* ppm) {
+	unsigned value = ppm->sampleBytes == 2 ? (unsigned)p[0] << 8 | p[1] : p[0];
+	unsigned maxValue = ppm->maxColorValue;
+
+	return value >= maxValue ? 255 : (unsigned char)((value * 255 + maxValue / 2) / maxValue);
+}
+
+// Samples every stride-th row and column of a P6 file into previews[level],
+// reading only those rows, then hands the preview to the render thread.
+// Returns 0 when the file is short or loading was cancelled.
+int loadPreview(FILE* fh, const PPMImage* ppm, int level) {
+	Preview* preview = &previews[level];
+	int stride = preview_strides[level];
+	size_t texel = 3 * ppm->sampleBytes;
+	size_t rowSize = ppm->width * texel;
+	unsigned char* row = malloc(rowSize);
+
+	preview->width = (ppm->width - 1) / stride + 1;
+	preview->height = (ppm->height - 1) / stride + 1;
+	preview->pixels = malloc(checkedMultiply(checkedMultiply(preview->width, preview->height), 4));
+	if (row == NULL || preview->pixels == NULL) {
+		fprintf(stderr, "Error: Not enough memory for image.\n");
+		exit(1);
+	}
+
+	for (int y = 0; y < preview->height; y++) {
+		unsigned char* out = preview->pixels + (size_t)y * preview->width * 4;
+		long long offset = (long long)ppm->headerSize + (long long)rowSize * y * stride;
+
+		if (atomicLoad(&loading_cancelled) || !readFileAt(fh, row, rowSize, offset)) {
+			free(row);
+			return 0;
+		}
+		for (int x = 0; x < preview->width; x++) {
+			const unsigned char* in = row + texel * x * stride;
+
+			for (int channel = 0; channel < 3; channel++) {
+				out[x * 4 + channel] = previewSample(in + channel * ppm->sampleBytes, ppm);
+			}
+			out[x * 4 + 3] = 255;
+		}
+	}
+	free(row);
+
+	atomicStore(&previews_ready, level + 1);
+	if (atomicLoad(&window_open)) {
+		glfwPostEmptyEvent();
+	}
+	return 1;
+}
+
+// Decodes the raster of the viewed image on its own thread so the window can
+// open straight after the header has been read.
+ThreadResult THREAD_CALL runLoader(void* arg) {
+	FILE* fh = arg;
+	double start = currentTime();
+
+	if (progressive_loading && loading_async) {
+		for (int level = 0; level < PREVIEW_COUNT && loadPreview(fh, &image, level); level++) {
+			traceEnd("load preview", TRACE_LOADER, start);
+			start = currentTime();
+		}
+	}
+	if (streaming) {
+		streamPPMData(fh, &image);
+	} else {
+		loadPPMData(fh, &image);
+	}
+	traceEnd("load", TRACE_LOADER, start);
+	if (fh != stdin) {
+		fclose(fh);
+	}
+	return 0;
+}
+
+#define TILE_SIZE 1024	// Must be a power of two
+#define TILE_UPLOAD_BUDGET 0.008	// Seconds of each frame spent uploading tiles
+
+typedef struct {
+	GLuint texture;
+	int x, y;	// Top left pixel of the region of the image covered
+	int width, height;
+	int textureWidth, textureHeight;	// Padded to powers of two for mipmapping
+	int rowsUploaded;	// Level 0 rows shown while the tile is still loading
+	int allocated;	// Later uploads replace the mip chain in place
+} Tile;
+
+Tile* tiles;
+int tile_count;
+int tiles_uploaded;	// Tiles complete with mip chains, in order
+int rows_ready;		// Rows of image the loader has finished
+
+// Tiles are staged as RGBA. Every row is then a whole number of 4 byte texels,
+// which drivers upload without the per-texel swizzle RGB needs.
+unsigned char** tile_staging;	// One mip chain per tile prepared in parallel
+int tile_staging_count;
+size_t tile_staging_size;	// Bytes in the largest tile's mip chain
+int tile_staging_kept;	// Set while new frames keep replacing the tiles
+
+#ifndef GL_PIXEL_UNPACK_BUFFER_NV
+#define GL_PIXEL_UNPACK_BUFFER_NV 0x88EC
+#endif
+
+// With NV_pixel_buffer_object or ES3, mip chains are built straight into a
+// mapped pixel buffer and uploaded from it. Two buffers take turns, so the
+// driver can still be copying one batch while the next is being built.
+PFNGLMAPBUFFERRANGEEXTPROC mapBufferRange;
+PFNGLUNMAPBUFFEROESPROC unmapBuffer;
+GLuint pixel_buffers[2];
+int pixel_buffer_next;
+int pixel_buffers_allowed = 1;	// Cleared by --no-pbo
+
+int mip_filter = 'b';	// 'b'ox or 'l'anczos
+
+// 16 bit images upload as norm16 or half float textures where the driver has
+// either, and are dithered to 8 bits where it has neither.
+GLenum texture_type = GL_UNSIGNED_BYTE;
+GLint texture_format = GL_RGBA;	// Internal format of the tiles
+unsigned short* half_floats;	// Each norm16 value as a half float, for GL_HALF_FLOAT_OES
+
+// Bytes in a texel of the tiles: RGBA at 8 or 16 bits a channel.
+int texelBytes() {
+	return texture_type == GL_UNSIGNED_BYTE ? 4 : 8;
+}
+
+int nextPowerOfTwo(int value) {
+	int power = 1;
+	while (power < value) {
+		power *= 2;
+	}
+	return power;
+}
+
+size_t mipChainSize(int width, int height) {
+	size_t size = 0;
+	for (;;) {
+		size += (size_t)width * height * texelBytes();
+		if (width == 1 && height == 1) {
+			return size;
+		}
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
+}
+
+// Cache line aligned buffers for staging texels.
+void* allocateStaging(size_t size) {
+#ifdef _WIN32
+	return _aligned_malloc(size, 64);
+#else
+	void* buffer;
+	return posix_memalign(&buffer, 64, size) == 0 ? buffer : NULL;
+#endif
+}
+
+void freeStaging(void* buffer) {
+#ifdef _WIN32
+	_aligned_free(buffer);
+#else
+	free(buffer);
+#endif
+}
+
+// Widens count packed RGB texels to opaque RGBA, four at a time with SSSE3.
+void expandRGBA(const unsigned char* src, int count, unsigned char* dst) {
+	int i = 0;
+
+#ifdef EZVIEW_SSSE3
+	__m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	__m128i alpha = _mm_set1_epi32((int)0xFF000000);
+
+	// Each load reads 16 bytes for 12, so stop before it could pass the end
+	for (; i + 6 <= count; i += 4) {
+		__m128i rgb = _mm_loadu_si128((const __m128i*)(src + i * 3));
+		_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_shuffle_epi8(rgb, shuffle), alpha));
+	}
+#endif
+	for (; i < count; i++) {
+		dst[i * 4] = src[i * 3];
+		dst[i * 4 + 1] = src[i * 3 + 1];
+		dst[i * 4 + 2] = src[i * 3 + 2];
+		dst[i * 4 + 3] = 255;
+	}
+}
+
+// The same for 16 bit channels, two texels at a time with SSSE3.
+void expandRGBA16(const unsigned short* src, int count, unsigned short* dst) {
+	int i = 0;
+
+#ifdef EZVIEW_SSSE3
+	__m128i shuffle = _mm_setr_epi8(0, 1, 2, 3, 4, 5, -1, -1, 6, 7, 8, 9, 10, 11, -1, -1);
+	__m128i alpha = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+
+	for (; i + 3 <= count; i += 2) {
+		__m128i rgb = _mm_loadu_si128((const __m128i*)(src + i * 3));
+		_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_shuffle_epi8(rgb, shuffle), alpha));
+	}
+#endif
+	for (; i < count; i++) {
+		dst[i * 4] = src[i * 3];
+		dst[i * 4 + 1] = src[i * 3 + 1];
+		dst[i * 4 + 2] = src[i * 3 + 2];
+		dst[i * 4 + 3] = 65535;
+	}
+}
+
+// 4x4 ordered dither thresholds, in 16ths
+const unsigned char bayer_matrix[4][4] = {
+	{ 0, 8, 2, 10 },
+	{ 12, 4, 14, 6 },
+	{ 3, 11, 1, 9 },
+	{ 15, 7, 13, 5 }
+};
+
+// Narrows count 16 bit RGB texels to 8 bits with an ordered dither, keyed to
+// their position in the image so neighbouring tiles line up. Writes RGBA when
+// channels is 4. Each texel is read before its output is written, so dst may
+// be src.
+void ditherTexels(const unsigned short* src, int count, int row, int column, int channels, unsigned char* dst) {
+	const unsigned char* thresholds = bayer_matrix[row & 3];
+
+	for (int i = 0; i < count; i++) {
+		// A threshold of (t + 0.5) / 16 of a step, where a step is 257
+		unsigned offset = (thresholds[(column + i) & 3] * 2 + 1) * 257 / 32;
+		unsigned r = (src[i * 3] + offset) / 257;
+		unsigned g = (src[i * 3 + 1] + offset) / 257;
+		unsigned b = (src[i * 3 + 2] + offset) / 257;
+
+		dst[i * channels] = (unsigned char)r;
+		dst[i * channels + 1] = (unsigned char)g;
+		dst[i * channels + 2] = (unsigned char)b;
+		if (channels == 4) {
+			dst[i * channels + 3] = 255;
+		}
+	}
+}
+
+// Converts count texels at src, which are at column in a row of the image, to
+// the tiles' texel format.
+void stageSamples(const unsigned char* src, int row, int column, int count, unsigned char* dst) {
+	if (image.sampleBytes == 1) {
+		expandRGBA(src, count, dst);
+	} else if (texture_type == GL_UNSIGNED_BYTE) {
+		ditherTexels((const unsigned short*)src, count, row, column, 4, dst);
+	} else {
+		expandRGBA16((const unsigned short*)src, count, (unsigned short*)dst);
+	}
+}
+
+void stageTexels(int row, int column, int count, unsigned char* dst) {
+	size_t offset = ((size_t)row * image.width + column) * 3 * image.sampleBytes;
+	stageSamples(image.pixels + offset, row, column, count, dst);
+}
+
+// Dithers a 16 bit image down to 8 bits in place.
+void narrowImage(PPMImage* ppm) {
+	for (int row = 0; row < ppm->height; row++) {
+		size_t offset = (size_t)row * ppm->width * 3;
+		ditherTexels((const unsigned short*)ppm->pixels + offset, ppm->width, row, 0, 3, ppm->pixels + offset);
+	}
+	ppm->sampleBytes = 1;
+}
+
+unsigned short halfFromFloat(float value) {
+	unsigned bits, mantissa;
+	int exponent;
+
+	memcpy(&bits, &value, sizeof(bits));
+	exponent = (int)((bits >> 23) & 0xFF) - 127 + 15;
+	mantissa = bits & 0x7FFFFF;
+	if (exponent <= 0) {	// Subnormal
+		if (exponent < -10) {
+			return 0;
+		}
+		mantissa |= 0x800000;
+		return (unsigned short)((mantissa >> (14 - exponent)) + ((mantissa >> (13 - exponent)) & 1));
+	}
+	// Rounding may carry into the exponent, which is still the nearest half
+	return (unsigned short)(((unsigned)exponent << 10 | mantissa >> 13) + ((mantissa >> 12) & 1));
+}
+
+void convertHalfFloats(unsigned short* values, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		values[i] = half_floats[values[i]];
+	}
+}
+
+// 2x2 box filter. Rows are summed with SSE2 into 16 bit lanes, then each pair
+// of pixels is folded together.
+void downsampleBox(const unsigned char* src, int width, int height, unsigned char* dst) {
+	unsigned short sums[TILE_SIZE * 4];
+	int dstWidth = width > 1 ? width / 2 : 1;
+	int dstHeight = height > 1 ? height / 2 : 1;
+	int rowBytes = width * 4;
+	int next = width > 1 ? 4 : 0;
+
+	for (int y = 0; y < dstHeight; y++) {
+		const unsigned char* row0 = src + (size_t)(y * 2) * rowBytes;
+		const unsigned char* row1 = height > 1 ? row0 + rowBytes : row0;
+		int x = 0;
+
+#ifdef EZVIEW_SSE2
+		__m128i zero = _mm_setzero_si128();
+		for (; x + 16 <= rowBytes; x += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(row0 + x));
+			__m128i b = _mm_loadu_si128((const __m128i*)(row1 + x));
+			_mm_storeu_si128((__m128i*)(sums + x),
+					 _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)));
+			_mm_storeu_si128((__m128i*)(sums + x + 8),
+					 _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)));
+		}
+#endif
+		for (; x < rowBytes; x++) {
+			sums[x] = row0[x] + row1[x];
+		}
+
+		unsigned char* out = dst + (size_t)y * dstWidth * 4;
+		for (x = 0; x < dstWidth * 4; x++) {
+			const unsigned short* pair = sums + (x & ~3) * 2 + (x & 3);
+			out[x] = (pair[0] + pair[next] + 2) >> 2;
+		}
+	}
+}
+
+void downsampleBox16(const unsigned short* src, int width, int height, unsigned short* dst) {
+	int dstWidth = width > 1 ? width / 2 : 1;
+	int dstHeight = height > 1 ? height / 2 : 1;
+	int rowValues = width * 4;
+	int next = width > 1 ? 4 : 0;
+
+	for (int y = 0; y < dstHeight; y++) {
+		const unsigned short* row0 = src + (size_t)(y * 2) * rowValues;
+		const unsigned short* row1 = height > 1 ? row0 + rowValues : row0;
+		unsigned short* out = dst + (size_t)y * dstWidth * 4;
+
+		for (int x = 0; x < dstWidth * 4; x++) {
+			int i = (x & ~3) * 2 + (x & 3);
+			out[x] = (unsigned short)((row0[i] + row0[i + next] + row1[i] + row1[i + next] + 2) >> 2);
+		}
+	}
+}
+
+// Lanczos-3 stretched to halve the image: 12 taps at input offsets -5..6
+// around 2 * x, applied horizontally then vertically.
+float lanczos_weights[12];
+
+void initLanczosWeights() {
+	float total = 0;
+	for (int i = 0; i < 12; i++) {
+		float d = (i - 5.5f) / 2;
+		float a = (float)PI * d;
+		lanczos_weights[i] = 3 * sinf(a) * sinf(a / 3) / (a * a);
+		total += lanczos_weights[i];
+	}
+	for (int i = 0; i < 12; i++) {
+		lanczos_weights[i] /= total;
+	}
+}
+
+// Channels are 16 bit when wide is set.
+void downsampleLanczos(const unsigned char* src, int width, int height, int wide, unsigned char* dst) {
+	const unsigned short* src16 = (const unsigned short*)src;
+	float full = wide ? 65535.0f : 255.0f;
+	int dstWidth = width > 1 ? width / 2 : 1;
+	int dstHeight = height > 1 ? height / 2 : 1;
+	float* rows = malloc(sizeof(float) * dstWidth * height * 4);
+
+	if (rows == NULL) {
+		fprintf(stderr, "Error: Not enough memory for image.\n");
+		exit(1);
+	}
+
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < dstWidth; x++) {
+			float sum[4] = { 0, 0, 0, 0 };
+			for (int i = 0; i < 12; i++) {
+				int sx = x * 2 - 5 + i;
+				sx = sx < 0 ? 0 : sx >= width ? width - 1 : sx;
+				size_t pixel = ((size_t)y * width + sx) * 4;
+				for (int c = 0; c < 4; c++) {
+					sum[c] += lanczos_weights[i] * (wide ? src16[pixel + c] : src[pixel + c]);
+				}
+			}
+			memcpy(rows + ((size_t)y * dstWidth + x) * 4, sum, sizeof(sum));
+		}
+	}
+
+	for (int y = 0; y < dstHeight; y++) {
+		for (int x = 0; x < dstWidth * 4; x++) {
+			float sum = 0;
+			for (int i = 0; i < 12; i++) {
+				int sy = y * 2 - 5 + i;
+				sy = sy < 0 ? 0 : sy >= height ? height - 1 : sy;
+				sum += lanczos_weights[i] * rows[(size_t)sy * dstWidth * 4 + x];
+			}
+			sum += 0.5f;
+			sum = sum < 0 ? 0 : sum > full ? full : sum;
+			if (wide) {
+				((unsigned short*)dst)[(size_t)y * dstWidth * 4 + x] = (unsigned short)sum;
+			} else {
+				dst[(size_t)y * dstWidth * 4 + x] = (unsigned char)sum;
+			}
+		}
+	}
+
+	free(rows);
+}
+
+// Picks how the tiles of the image store their texels.
+void chooseTextureFormat() {
+	const char* version = (const char*)glGetString(GL_VERSION);
+	const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+
+	texture_type = GL_UNSIGNED_BYTE;
+	texture_format = GL_RGBA;
+	if (image.sampleBytes == 1 || version == NULL || extensions == NULL) {
+		return;
+	}
+	// Sized internal formats need OpenGL ES 3
+	if (!strncmp(version, "OpenGL ES 3", 11) && strstr(extensions, "GL_EXT_texture_norm16")) {
+		texture_type = GL_UNSIGNED_SHORT;
+		texture_format = GL_RGBA16_EXT;
+	} else if (!streaming && strstr(extensions, "GL_OES_texture_half_float") &&
+		   strstr(extensions, "GL_OES_texture_half_float_linear")) {
+		// Streamed tiles have their mips generated by the driver, which
+		// OpenGL ES 2 only does for formats it can render to
+		texture_type = GL_HALF_FLOAT_OES;
+		if (half_floats == NULL) {
+			half_floats = malloc(sizeof(unsigned short) * 65536);
+			if (half_floats == NULL) {
+				fprintf(stderr, "Error: Not enough memory for image.\n");
+				exit(1);
+			}
+			for (int value = 0; value < 65536; value++) {
+				half_floats[value] = halfFromFloat(value / 65535.0f);
+			}
+		}
+	}
+}
+
+void createPixelBuffers() {
+	const char* version = (const char*)glGetString(GL_VERSION);
+	const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+
+	if (!pixel_buffers_allowed || version == NULL || extensions == NULL) {
+		return;
+	}
+	if (!strncmp(version, "OpenGL ES 3", 11)) {
+		mapBufferRange = (PFNGLMAPBUFFERRANGEEXTPROC)eglGetProcAddress("glMapBufferRange");
+		unmapBuffer = (PFNGLUNMAPBUFFEROESPROC)eglGetProcAddress("glUnmapBuffer");
+	} else if (strstr(extensions, "GL_NV_pixel_buffer_object") && strstr(extensions, "GL_EXT_map_buffer_range")) {
+		mapBufferRange = (PFNGLMAPBUFFERRANGEEXTPROC)eglGetProcAddress("glMapBufferRangeEXT");
+		unmapBuffer = (PFNGLUNMAPBUFFEROESPROC)eglGetProcAddress("glUnmapBufferOES");
+	}
+	if (mapBufferRange == NULL || unmapBuffer == NULL) {
+		mapBufferRange = NULL;
+		return;
+	}
+
+	glGenBuffers(2, pixel_buffers);
+	for (int i = 0; i < 2; i++) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, pixel_buffers[i]);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER_NV, tile_staging_size * tile_staging_count, NULL, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, 0);
+	pixel_buffer_next = 0;
+}
+
+void deletePixelBuffers() {
+	if (mapBufferRange != NULL) {
+		glDeleteBuffers(2, pixel_buffers);
+		mapBufferRange = NULL;
+	}
+}
+
+// Binds the next pixel buffer and maps it for a batch of mip chains, or
+// returns NULL when they have to be staged in client memory instead.
+unsigned char* mapPixelBuffer(int batch) {
+	unsigned char* mapped;
+
+	if (mapBufferRange == NULL) {
+		return NULL;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, pixel_buffers[pixel_buffer_next]);
+	pixel_buffer_next ^= 1;
+
+	// Invalidating lets the driver hand back fresh storage rather than wait
+	// for an upload still reading the old contents
+	mapped = mapBufferRange(GL_PIXEL_UNPACK_BUFFER_NV, 0, tile_staging_size * batch,
+				GL_MAP_WRITE_BIT_EXT | GL_MAP_INVALIDATE_BUFFER_BIT_EXT);
+	if (mapped == NULL) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, 0);
+	}
+	return mapped;
+}
+
+void setVertex(Vertex* vertex, float x, float y, float s, float t) {
+	vertex->Position[0] = x;
+	vertex->Position[1] = y;
+	vertex->TexCoord[0] = s;
+	vertex->TexCoord[1] = t;
+}
+
+// Splits the image into tiles no larger than the driver allows and returns two
+// triangles per tile covering its share of the [-x, x] by [-y, y] quad, then
+// two covering the whole quad for the progressive preview.
+Vertex* createTiles(float x, float y) {
+	GLint maxTextureSize;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+
+	int size = TILE_SIZE;
+	while (size > maxTextureSize) {
+		size /= 2;
+	}
+	int columns = (image.width - 1) / size + 1;
+	int rows = (image.height - 1) / size + 1;
+
+	// Each tile draws six vertexes, counted in an int
+	if (columns > (INT_MAX / 6 - 1) / rows) {
+		fprintf(stderr, "Error: Image is too large.\n");
+		exit(1);
+	}
+	tile_count = columns * rows;
+	tiles = malloc(sizeof(Tile) * tile_count);
+	Vertex* vertexes = malloc(sizeof(Vertex) * 6 * (tile_count + 1));
+	if (tiles == NULL || vertexes == NULL) {
+		fprintf(stderr, "Error: Not enough memory for image.\n");
+		exit(1);
+	}
+
+	for (int i = 0; i < tile_count; i++) {
+		Tile* tile = &tiles[i];
+		Vertex* vertex = &vertexes[i * 6];
+
+		tile->x = i % columns * size;
+		tile->y = i / columns * size;
+		tile->width = image.width - tile->x < size ? image.width - tile->x : size;
+		tile->height = image.height - tile->y < size ? image.height - tile->y : size;
+		tile->textureWidth = nextPowerOfTwo(tile->width);
+		tile->textureHeight = nextPowerOfTwo(tile->height);
+		tile->rowsUploaded = 0;
+		tile->allocated = 0;
+
+		glGenTextures(1, &tile->texture);
+		glBindTexture(GL_TEXTURE_2D, tile->texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		float left = -x + 2 * x * tile->x / image.width;
+		float right = -x + 2 * x * (tile->x + tile->width) / image.width;
+		float bottom = -y + 2 * y * tile->y / image.height;
+		float top = -y + 2 * y * (tile->y + tile->height) / image.height;
+		float s = tile->width / (float)tile->textureWidth;
+		float t = tile->height / (float)tile->textureHeight;
+
+		setVertex(&vertex[0], right, bottom, s, 0);
+		setVertex(&vertex[1], right, top, s, t);
+		setVertex(&vertex[2], left, top, 0, t);
+		setVertex(&vertex[3], left, top, 0, t);
+		setVertex(&vertex[4], left, bottom, 0, 0);
+		setVertex(&vertex[5], right, bottom, s, 0);
+	}
+
+	Vertex* vertex = &vertexes[tile_count * 6];
+	setVertex(&vertex[0], x, -y, 1, 0);
+	setVertex(&vertex[1], x, y, 1, 1);
+	setVertex(&vertex[2], -x, y, 0, 1);
+	setVertex(&vertex[3], -x, y, 0, 1);
+	setVertex(&vertex[4], -x, -y, 0, 0);
+	setVertex(&vertex[5], x, -y, 1, 0);
+
+	// Mip chains for a batch of tiles are built concurrently, one buffer each.
+	// Streamed tiles only ever stage one tile's rows at a time.
+	chooseTextureFormat();
+	tile_staging_count = getWorkerThreads() < tile_count ? getWorkerThreads() : tile_count;
+	if (streaming) {
+		tile_staging_count = 1;
+	}
+	tile_staging_size = mipChainSize(nextPowerOfTwo(size < image.width ? size : image.width),
+					 nextPowerOfTwo(size < image.height ? size : image.height));
+	tile_staging = malloc(sizeof(unsigned char*) * tile_staging_count);
+	for (int i = 0; tile_staging != NULL && i < tile_staging_count; i++) {
+		tile_staging[i] = allocateStaging(tile_staging_size);
+		if (tile_staging[i] == NULL) {
+			tile_staging = NULL;
+		}
+	}
+	if (tile_staging == NULL) {
+		fprintf(stderr, "Error: Not enough memory for image.\n");
+		exit(1);
+	}
+	if (mip_filter == 'l') {
+		initLanczosWeights();
+	}
+	if (!streaming) {
+		createPixelBuffers();
+	}
+
+	return vertexes;
+}
+
+// Expands a tile to RGBA in the top left of its padded texture, repeating the
+// last column and row into the padding, then builds the rest of the mip chain.
+// Chains go to the mapped pixel buffer given as context, else to tile_staging.
+void prepareTile(void* context, int index) {
+	Tile* tile = &tiles[tiles_uploaded + index];
+	unsigned char* chain = context != NULL ? (unsigned char*)context + tile_staging_size * index
+					       : tile_staging[index];
+	unsigned char* level = chain;
+	int texel = texelBytes();
+	size_t rowBytes = (size_t)tile->textureWidth * texel;
+	int width = tile->textureWidth;
+	int height = tile->textureHeight;
+
+	for (int row = 0; row < height; row++) {
+		unsigned char* out = level + row * rowBytes;
+
+		if (row >= tile->height) {
+			memcpy(out, out - rowBytes, rowBytes);
+			continue;
+		}
+		stageTexels(tile->y + row, tile->x, tile->width, out);
+		for (int column = tile->width; column < width; column++) {
+			memcpy(out + column * texel, out + (tile->width - 1) * texel, texel);
+		}
+	}
+
+	while (width > 1 || height > 1) {
+		unsigned char* next = level + (size_t)width * height * texel;
+		if (mip_filter == 'l') {
+			downsampleLanczos(level, width, height, texel == 8, next);
+		} else if (texel == 8) {
+			downsampleBox16((const unsigned short*)level, width, height, (unsigned short*)next);
+		} else {
+			downsampleBox(level, width, height, next);
+		}
+		level = next;
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
+
+	// Mips are filtered as norm16, then the whole chain converted
+	if (texture_type == GL_HALF_FLOAT_OES) {
+		convertHalfFloats((unsigned short*)chain, (level + texel - chain) / 2);
+	}
+}
+
+void uploadTile(Tile* tile, const unsigned char* levels) {
+	int width = tile->textureWidth;
+	int height = tile->textureHeight;
+
+	glBindTexture(GL_TEXTURE_2D, tile->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	for (int level = 0; ; level++) {
+		if (tile->allocated) {
+			glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, width, height, GL_RGBA,
+					texture_type, levels);
+		} else {
+			glTexImage2D(GL_TEXTURE_2D, level, texture_format, width, height, 0, GL_RGBA,
+				     texture_type, levels);
+		}
+		if (width == 1 && height == 1) {
+			break;
+		}
+		levels += (size_t)width * height * texelBytes();
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
+	tile->allocated = 1;
+}
+
+void freeTileStaging() {
+	for (int i = 0; i < tile_staging_count; i++) {
+		freeStaging(tile_staging[i]);
+	}
+	free(tile_staging);
+	tile_staging = NULL;
+	tile_staging_count = 0;
+	deletePixelBuffers();
+}
+
+// Shows the decoded rows of a tile that is not complete yet in its level 0,
+// over a black placeholder.
+void uploadTileRows(Tile* tile, int rows) {
+	double start = currentTime();
+	unsigned char* staging = tile_staging[0];
+	int texel = texelBytes();
+
+	glBindTexture(GL_TEXTURE_2D, tile->texture);
+	if (tile->rowsUploaded == 0) {
+		// Zero is black as a half float too
+		memset(staging, 0, (size_t)tile->textureWidth * tile->textureHeight * texel);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, texture_format, tile->textureWidth, tile->textureHeight, 0,
+			     GL_RGBA, texture_type, staging);
+	}
+
+	for (int row = tile->rowsUploaded; row < rows; row++) {
+		stageTexels(tile->y + row, tile->x, tile->width,
+			    staging + (size_t)(row - tile->rowsUploaded) * tile->width * texel);
+	}
+	if (texture_type == GL_HALF_FLOAT_OES) {
+		convertHalfFloats((unsigned short*)staging, (size_t)(rows - tile->rowsUploaded) * tile->width * 4);
+	}
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, tile->rowsUploaded, tile->width, rows - tile->rowsUploaded,
+			GL_RGBA, texture_type, staging);
+	tile->rowsUploaded = rows;
+	traceEnd("upload rows", TRACE_MAIN, start);
+}
+
+// Uploads the rows of a streamed band that fall in tile into its level 0,
+// padded like prepareTile pads them. After the tile's last row the driver
+// generates the rest of the mip chain.
+void uploadStreamRows(Tile* tile, const RowBand* band) {
+	int first = band->first > tile->y ? band->first : tile->y;
+	int last = band->first + band->count < tile->y + tile->height ? band->first + band->count
+								       : tile->y + tile->height;
+	unsigned char* staging = tile_staging[0];
+	int texel = texelBytes();
+	size_t rowBytes = (size_t)tile->textureWidth * texel;
+	size_t rowSamples = (size_t)image.width * 3 * image.sampleBytes;
+	int rows = last - first;
+
+	if (first >= last) {
+		return;
+	}
+	glBindTexture(GL_TEXTURE_2D, tile->texture);
+	if (!tile->allocated) {
+		memset(staging, 0, rowBytes * tile->textureHeight);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, texture_format, tile->textureWidth, tile->textureHeight, 0,
+			     GL_RGBA, texture_type, staging);
+		tile->allocated = 1;
+	}
+
+	for (int row = first; row < last; row++) {
+		unsigned char* out = staging + (size_t)(row - first) * rowBytes;
+
+		stageSamples(band->pixels + (size_t)(row - band->first) * rowSamples + (size_t)tile->x * 3 * image.sampleBytes,
+			     row, tile->x, tile->width, out);
+		for (int column = tile->width; column < tile->textureWidth; column++) {
+			memcpy(out + column * texel, out + (tile->width - 1) * texel, texel);
+		}
+	}
+	if (last == tile->y + tile->height) {
+		for (; first + rows < tile->y + tile->textureHeight; rows++) {
+			memcpy(staging + rows * rowBytes, staging + (rows - 1) * rowBytes, rowBytes);
+		}
+	}
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first - tile->y, tile->textureWidth, rows, GL_RGBA, texture_type, staging);
+	tile->rowsUploaded = last - tile->y;
+
+	if (tile->rowsUploaded == tile->height) {
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	}
+}
+
+// Uploads a streamed band into every tile it touches and hands its buffer back
+// to the loader. Tiles it completes count as uploaded.
+void uploadStreamBand(const RowBand* band) {
+	double start = currentTime();
+
+	for (int i = tiles_uploaded; i < tile_count && tiles[i].y < band->first + band->count; i++) {
+		uploadStreamRows(&tiles[i], band);
+	}
+	while (tiles_uploaded < tile_count && tiles[tiles_uploaded].rowsUploaded == tiles[tiles_uploaded].height) {
+		tiles_uploaded++;
+	}
+	atomicIncrement(&stream_bands_released);
+	traceEnd("upload band", TRACE_MAIN, start);
+}
+
+// Takes the row bands the loader has finished and shows them in the tiles they
+// only partly fill. Tiles that are complete are left to uploadTiles. Returns 1
+// when anything new reached the screen. Progressive loads skip partly filled
+// tiles, whose black placeholders would hide the preview.
+int receiveTileRows() {
+	RowBand band;
+	int changed = 0;
+
+	if (!loading_async) {
+		rows_ready = image.height;
+		return 0;
+	}
+	while (receiveRows(&band)) {
+		if (band.first + band.count > rows_ready) {
+			rows_ready = band.first + band.count;
+		}
+		if (band.pixels != NULL) {
+			uploadStreamBand(&band);
+			changed = 1;
+		}
+	}
+	for (int i = tiles_uploaded; !progressive_loading && i < tile_count && tiles[i].y < rows_ready; i++) {
+		Tile* tile = &tiles[i];
+		if (tile->y + tile->height > rows_ready && tile->rowsUploaded < rows_ready - tile->y) {
+			uploadTileRows(tile, rows_ready - tile->y);
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+int tileReady(int index) {
+	return index < tile_count && tiles[index].y + tiles[index].height <= rows_ready;
+}
+
+// Prepares and uploads batches of tiles until the frame's budget is spent, so
+// the window stays responsive while a large image is still arriving. Returns 1
+// when any tile was uploaded.
+int uploadTiles() {
+	double start = currentTime();
+	int uploaded = tiles_uploaded;
+
+	while (tileReady(tiles_uploaded)) {
+		int batch = 1;
+		while (batch < tile_staging_count && tileReady(tiles_uploaded + batch)) {
+			batch++;
+		}
+
+		double prepared = currentTime();
+		unsigned char* mapped = mapPixelBuffer(batch);
+		parallelFor(batch, prepareTile, mapped);
+		if (mapped != NULL && !unmapBuffer(GL_PIXEL_UNPACK_BUFFER_NV)) {
+			// The buffer's contents were lost, so build the batch again
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, 0);
+			mapped = NULL;
+			parallelFor(batch, prepareTile, NULL);
+		}
+
+		traceEnd("prepare tiles", TRACE_MAIN, prepared);
+
+		// From a bound pixel buffer, uploads read offsets into it and return
+		// without waiting for the copy
+		double uploadStart = currentTime();
+		for (int i = 0; i < batch; i++) {
+			uploadTile(&tiles[tiles_uploaded + i],
+				   mapped != NULL ? (const unsigned char*)(tile_staging_size * i) : tile_staging[i]);
+		}
+		if (mapped != NULL) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, 0);
+		}
+		traceEnd("upload tiles", TRACE_MAIN, uploadStart);
+		tiles_uploaded += batch;
+
+		if (currentTime() - start > TILE_UPLOAD_BUDGET) {
+			break;
+		}
+	}
+	if (tiles_uploaded == tile_count && tile_staging != NULL && !tile_staging_kept) {
+		freeTileStaging();
+	}
+	return tiles_uploaded != uploaded;
+}
+
+GLuint preview_texture;	// The newest preview, drawn behind the tiles until they are all uploaded
+long previews_shown;
+
+// Swaps in the newest preview the loader has finished. It goes into a new
+// texture and the old one is deleted only then, so every frame shows one
+// whole preview. Returns 1 when it changed.
+int receivePreview() {
+	long ready = atomicLoad(&previews_ready);
+	GLint maxTextureSize;
+	GLuint texture;
+
+	if (ready == previews_shown) {
+		return 0;
+	}
+
+	Preview* preview = &previews[ready - 1];
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	if (tiles_uploaded < tile_count && preview->width <= maxTextureSize && preview->height <= maxTextureSize) {
+		double start = currentTime();
+
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, preview->width, preview->height, 0, GL_RGBA,
+			     GL_UNSIGNED_BYTE, preview->pixels);
+		glDeleteTextures(1, &preview_texture);
+		preview_texture = texture;
+		traceEnd("upload preview", TRACE_MAIN, start);
+	}
+
+	for (long i = previews_shown; i < ready; i++) {
+		free(previews[i].pixels);
+		previews[i].pixels = NULL;
+	}
+	previews_shown = ready;
+	return 1;
+}
+
+void drawTiles() {
+	// Once every tile is in, the preview is covered for good
+	if (preview_texture != 0 && tiles_uploaded == tile_count) {
+		glDeleteTextures(1, &preview_texture);
+		preview_texture = 0;
+	}
+	if (preview_texture != 0) {
+		glBindTexture(GL_TEXTURE_2D, preview_texture);
+		glDrawArrays(GL_TRIANGLES, tile_count * 6, 6);
+	}
+
+	for (int i = 0; i < tile_count; i++) {
+		if (i >= tiles_uploaded && (tiles[i].rowsUploaded == 0 || progressive_loading)) {
+			continue;
+		}
+		glBindTexture(GL_TEXTURE_2D, tiles[i].texture);
+		glDrawArrays(GL_TRIANGLES, i * 6, 6);
+	}
+}
+
+void deleteTiles() {
+	for (int i = 0; i < tile_count; i++) {
+		glDeleteTextures(1, &tiles[i].texture);
+	}
+	glDeleteTextures(1, &preview_texture);
+	preview_texture = 0;
+	free(tiles);
+	freeTileStaging();
+	tiles = NULL;
+	tile_count = 0;
+	tiles_uploaded = 0;
+}
+
+// GPU time for each frame, from EXT_disjoint_timer_query where the driver has
+// it. Queries are read back a few frames later so waiting never stalls.
+#define GPU_TIMER_COUNT 4
+
+PFNGLGENQUERIESEXTPROC genQueries;
+PFNGLDELETEQUERIESEXTPROC deleteQueries;
+PFNGLBEGINQUERYEXTPROC beginQuery;
+PFNGLENDQUERYEXTPROC endQuery;
+PFNGLGETQUERYOBJECTUIVEXTPROC getQueryObjectuiv;
+PFNGLGETQUERYOBJECTUI64VEXTPROC getQueryObjectui64v;
+GLuint gpu_timers[GPU_TIMER_COUNT];
+double gpu_timer_starts[GPU_TIMER_COUNT];	// CPU time each query began, 0 when free
+int gpu_timer_next;
+int gpu_timer_running;
+
+void createGPUTimers() {
+	const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+
+	if (!(tracing || frame_stats) || extensions == NULL || !strstr(extensions, "GL_EXT_disjoint_timer_query")) {
+		return;
+	}
+	genQueries = (PFNGLGENQUERIESEXTPROC)eglGetProcAddress("glGenQueriesEXT");
+	deleteQueries = (PFNGLDELETEQUERIESEXTPROC)eglGetProcAddress("glDeleteQueriesEXT");
+	beginQuery = (PFNGLBEGINQUERYEXTPROC)eglGetProcAddress("glBeginQueryEXT");
+	endQuery = (PFNGLENDQUERYEXTPROC)eglGetProcAddress("glEndQueryEXT");
+	getQueryObjectuiv = (PFNGLGETQUERYOBJECTUIVEXTPROC)eglGetProcAddress("glGetQueryObjectuivEXT");
+	getQueryObjectui64v = (PFNGLGETQUERYOBJECTUI64VEXTPROC)eglGetProcAddress("glGetQueryObjectui64vEXT");
+	if (!genQueries || !deleteQueries || !beginQuery || !endQuery || !getQueryObjectuiv || !getQueryObjectui64v) {
+		genQueries = NULL;
+		return;
+	}
+	genQueries(GPU_TIMER_COUNT, gpu_timers);
+	memset(gpu_timer_starts, 0, sizeof(gpu_timer_starts));
+}
+
+void deleteGPUTimers() {
+	if (genQueries != NULL) {
+		deleteQueries(GPU_TIMER_COUNT, gpu_timers);
+		genQueries = NULL;
+	}
+}
+
+// Times the GL work up to endGPUTimer, unless every query is still in flight.
+void beginGPUTimer() {
+	if (genQueries == NULL || gpu_timer_starts[gpu_timer_next] != 0) {
+		return;
+	}
+	gpu_timer_starts[gpu_timer_next] = currentTime();
+	beginQuery(GL_TIME_ELAPSED_EXT, gpu_timers[gpu_timer_next]);
+	gpu_timer_running = 1;
+}
+
+void endGPUTimer() {
+	if (gpu_timer_running) {
+		endQuery(GL_TIME_ELAPSED_EXT);
+		gpu_timer_next = (gpu_timer_next + 1) % GPU_TIMER_COUNT;
+		gpu_timer_running = 0;
+	}
+}
+
+// Records the queries that have finished. Results are thrown away when the
+// driver reports a disjoint event, such as a clock change, since they began,
+// or when they are longer than the time since, which some drivers return for
+// the first query.
+void collectGPUTimers() {
+	GLint disjoint = 0;
+
+	if (genQueries == NULL) {
+		return;
+	}
+	glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+	for (int i = 0; i < GPU_TIMER_COUNT; i++) {
+		GLuint available = 0;
+		GLuint64 elapsed = 0;
+
+		if (gpu_timer_starts[i] == 0 || (i == gpu_timer_next && gpu_timer_running)) {
+			continue;
+		}
+		getQueryObjectuiv(gpu_timers[i], GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+		if (!available) {
+			continue;
+		}
+		getQueryObjectui64v(gpu_timers[i], GL_QUERY_RESULT_EXT, &elapsed);
+		if (!disjoint && elapsed * 1e-9 <= currentTime() - gpu_timer_starts[i]) {
+			traceSpan("gpu frame", TRACE_GPU, gpu_timer_starts[i], elapsed * 1e-9);
+			gpu_frame_time = elapsed * 1e-9;
+		}
+		gpu_timer_starts[i] = 0;
+	}
+}
+
+GLuint program;
+GLint mvp_location;
+GLuint vertex_buffer;
+GLint vpos_location;
+GLint texcoord_location;
+
+// Splits the image into tiles and fills the vertex buffer with their quads.
+void createGeometry(float x, float y)
+{
+    Vertex* vertexes = createTiles(x, y);
+
+    glGenBuffers(1, &vertex_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * 6 * (tile_count + 1), vertexes, GL_STATIC_DRAW);
+    free(vertexes);
+
+    glEnableVertexAttribArray(vpos_location);
+    glVertexAttribPointer(vpos_location,
+			  2,
+			  GL_FLOAT,
+			  GL_FALSE,
+                          sizeof(Vertex),
+			  (void*) 0);
+
+    glEnableVertexAttribArray(texcoord_location);
+    glVertexAttribPointer(texcoord_location,
+			  2,
+			  GL_FLOAT,
+			  GL_FALSE,
+                          sizeof(Vertex),
+			  (void*) (sizeof(float) * 2));
+}
+
+void destroyGeometry()
+{
+    deleteTiles();
+    glDeleteBuffers(1, &vertex_buffer);
+}
+
+// Compiles the shaders, creates the tiles and vertex buffer for a quad
+// spanning [-x, x] by [-y, y], and leaves everything bound for drawFrame.
+void createRenderer(float x, float y)
+{
+    GLuint vertex_shader, fragment_shader;
+
+    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertex_shader, 1, &vertex_shader_text, NULL);
+    glCompileShaderOrDie(vertex_shader);
+
+    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fragment_shader, 1, &fragment_shader_text, NULL);
+    glCompileShaderOrDie(fragment_shader);
+
+    program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glLinkProgram(program);
+    // more error checking! glLinkProgramOrDie!
+
+    mvp_location = glGetUniformLocation(program, "MVP");
+    assert(mvp_location != -1);
+
+    vpos_location = glGetAttribLocation(program, "vPos");
+    assert(vpos_location != -1);
+
+    texcoord_location = glGetAttribLocation(program, "TexCoordIn");
+    assert(texcoord_location != -1);
+
+    GLint tex_location = glGetUniformLocation(program, "Texture");
+    assert(tex_location != -1);
+
+    createGeometry(x, y);
+
+    // Staged rows are whole RGBA texels, so every row starts 4 byte aligned
+    // whatever the image width. Set it rather than trust the default.
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    glActiveTexture(GL_TEXTURE0);
+    glUseProgram(program);
+    glUniform1i(tex_location, 0);
+
+    createGPUTimers();
+}
+
+void destroyRenderer()
+{
+    deleteGPUTimers();
+    destroyGeometry();
+    glDeleteProgram(program);
+}
+
+void buildMVP(mat4x4 mvp)
+{
+    mat4x4 m;
+
+    mat4x4_identity(m);
+    mat4x4_translate(m, trans_x, trans_y, 0);
+    mat4x4_scale_lin(m, m, scale);
+    mat4x4_rotate_Z(m, m, rotation);
+    mat4x4_shear(mvp, m, shear);
+}
+
+void drawFrame(int width, int height)
+{
+    mat4x4 mvp;
+    double start;
+
+    beginGPUTimer();
+    glViewport(0, 0, width, height);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    start = currentTime();
+    buildMVP(mvp);
+    traceEnd("build mvp", TRACE_MAIN, start);
+
+    start = currentTime();
+    glUseProgram(program);
+    glUniformMatrix4fv(mvp_location, 1, GL_FALSE, (const GLfloat*) mvp);
+    drawTiles();
+    traceEnd("draw", TRACE_MAIN, start);
+    endGPUTimer();
+}
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+EGLDisplay headless_display = EGL_NO_DISPLAY;
+EGLContext headless_context = EGL_NO_CONTEXT;
+EGLSurface headless_surface = EGL_NO_SURFACE;
+
+// Creates an OpenGL ES 2.0 context with no window, preferring Mesa's
+// surfaceless platform so it runs without a display server or a GPU.
+void createHeadlessContext() {
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	EGLint configAttributes[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+		EGL_RED_SIZE, 8,
+		EGL_GREEN_SIZE, 8,
+		EGL_BLUE_SIZE, 8,
+		EGL_NONE
+	};
+	EGLint contextAttributes[] = { EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE };
+	EGLint pbufferAttributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+	EGLConfig config;
+	EGLint configs = 0;
+
+	if (getPlatformDisplay != NULL && extensions != NULL && strstr(extensions, "EGL_MESA_platform_surfaceless")) {
+		headless_display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	}
+	if (headless_display == EGL_NO_DISPLAY) {
+		headless_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+	if (headless_display == EGL_NO_DISPLAY || !eglInitialize(headless_display, NULL, NULL)) {
+		fprintf(stderr, "Error: Unable to open an EGL display.\n");
+		exit(1);
+	}
+	eglBindAPI(EGL_OPENGL_ES_API);
+
+	// Rendering goes to a framebuffer object, so the surface only has to make
+	// the context current. Without pbuffer support, go surfaceless.
+	if (eglChooseConfig(headless_display, configAttributes, &config, 1, &configs) && configs == 1) {
+		headless_surface = eglCreatePbufferSurface(headless_display, config, pbufferAttributes);
+	} else {
+		configAttributes[1] = 0;
+		eglChooseConfig(headless_display, configAttributes, &config, 1, &configs);
+	}
+	if (configs == 1) {
+		headless_context = eglCreateContext(headless_display, config, EGL_NO_CONTEXT, contextAttributes);
+	}
+	if (headless_context == EGL_NO_CONTEXT ||
+	    !eglMakeCurrent(headless_display, headless_surface, headless_surface, headless_context)) {
+		fprintf(stderr, "Error: Unable to create a headless OpenGL ES context.\n");
+		exit(1);
+	}
+}
+
+void destroyHeadlessContext() {
+	eglMakeCurrent(headless_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(headless_display, headless_context);
+	if (headless_surface != EGL_NO_SURFACE) {
+		eglDestroySurface(headless_display, headless_surface);
+	}
+	eglTerminate(headless_display);
+}
+
+// Writes bottom-up RGBA rows, as returned by glReadPixels, as a P6 file.
+void writePPM(const char* path, const unsigned char* pixels, int width, int height) {
+	FILE* fh = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+	unsigned char* row = malloc((size_t)width * 3);
+
+	if (fh == NULL || row == NULL) {
+		fprintf(stderr, "Error: Unable to write output file.\n");
+		exit(1);
+	}
+#ifdef _WIN32
+	if (fh == stdout) {
+		_setmode(_fileno(stdout), _O_BINARY);
+	}
+#endif
+
+	fprintf(fh, "P6\n%d %d\n255\n", width, height);
+	for (int y = height - 1; y >= 0; y--) {
+		const unsigned char* pixel = pixels + (size_t)y * width * 4;
+		for (int x = 0; x < width; x++) {
+			memcpy(row + x * 3, pixel + x * 4, 3);
+		}
+		fwrite(row, 1, (size_t)width * 3, fh);
+	}
+
+	free(row);
+	if (ferror(fh) || (fh != stdout && fclose(fh) != 0)) {
+		fprintf(stderr, "Error: Unable to write output file.\n");
+		exit(1);
+	}
+}
+
+// An offscreen framebuffer object and the texture it draws into.
+typedef struct {
+	GLuint texture;
+	GLuint framebuffer;
+} RenderTarget;
+
+// Creates a width x height RGBA framebuffer object and leaves it bound.
+void createRenderTarget(RenderTarget* target, int width, int height) {
+	GLint maxTextureSize;
+
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	if (width > maxTextureSize || height > maxTextureSize) {
+		fprintf(stderr, "Error: Output size too large.\n");
+		exit(1);
+	}
+
+	glGenTextures(1, &target->texture);
+	glBindTexture(GL_TEXTURE_2D, target->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+	glGenFramebuffers(1, &target->framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, target->framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target->texture, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		fprintf(stderr, "Error: Unable to render offscreen.\n");
+		exit(1);
+	}
+}
+
+void destroyRenderTarget(RenderTarget* target) {
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &target->framebuffer);
+	glDeleteTextures(1, &target->texture);
+}
+
+// Draws the tiles into the bound width x height render target and reads the
+// frame back.
+unsigned char* readFrame(int width, int height) {
+	drawFrame(width, height);
+
+	unsigned char* pixels = malloc((size_t)width * height * 4);
+	if (pixels == NULL) {
+		fprintf(stderr, "Error: Not enough memory for output.\n");
+		exit(1);
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	collectGPUTimers();
+	return pixels;
+}
+
+// Draws the loaded image with the current transform into a width x height
+// framebuffer object and returns what was drawn as bottom-up RGBA rows.
+unsigned char* renderOffscreen(int width, int height) {
+	RenderTarget target;
+
+	createRenderTarget(&target, width, height);
+	createRenderer(image.width / (float)width, image.height / (float)height);
+	receiveTileRows();
+	while (tiles_uploaded < tile_count) {
+		uploadTiles();
+	}
+	unsigned char* pixels = readFrame(width, height);
+
+	destroyRenderer();
+	destroyRenderTarget(&target);
+	return pixels;
+}
+
+// The software renderer draws the same quad as the GL path without a context.
+// Each output pixel centre goes back through the inverted MVP to a point in
+// the image, and the output is split into blocks so the source rows a block
+// reads stay in cache while it is drawn.
+#define SOFTWARE_BLOCK_SIZE 64
+
+char software_filter;	// 'n'earest or 'b'ilinear when --cpu replaces GL
+
+typedef struct {
+	const PPMImage* ppm;
+	unsigned char* pixels;
+	int width;
+	int height;
+	int columns;	// Blocks across the output
+	float origin[2];	// Image texel under the centre of output pixel (0, 0)
+	float stepX[2];	// Texel step for one output pixel to the right
+	float stepY[2];	// Texel step for one output row up
+} SoftwareJob;
+
+void copyTexel(const PPMImage* ppm, int column, int row, unsigned char* out) {
+	memcpy(out, ppm->pixels + ((size_t)row * ppm->width + column) * 3, 3);
+	out[3] = 255;
+}
+
+// Draws count pixels along a row starting at texel (u, v), taking the texel
+// each pixel centre falls in, like GL_NEAREST.
+void sampleNearest(const PPMImage* ppm, float u, float v, const float* step, int count, unsigned char* out) {
+	int i = 0;
+
+#ifdef EZVIEW_SSE2
+	__m128 lane = _mm_set_ps(3, 2, 1, 0);
+	__m128 zero = _mm_setzero_ps();
+	__m128 width = _mm_set1_ps((float)ppm->width);
+	__m128 height = _mm_set1_ps((float)ppm->height);
+	int columns[4], rows[4];
+
+	for (; i + 4 <= count; i += 4) {
+		__m128 index = _mm_add_ps(_mm_set1_ps((float)i), lane);
+		__m128 us = _mm_add_ps(_mm_set1_ps(u), _mm_mul_ps(index, _mm_set1_ps(step[0])));
+		__m128 vs = _mm_add_ps(_mm_set1_ps(v), _mm_mul_ps(index, _mm_set1_ps(step[1])));
+		__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(us, zero), _mm_cmplt_ps(us, width)),
+					   _mm_and_ps(_mm_cmpge_ps(vs, zero), _mm_cmplt_ps(vs, height)));
+		int mask = _mm_movemask_ps(inside);
+
+		// Truncation is a floor here, since anything negative is outside
+		_mm_storeu_si128((__m128i*)columns, _mm_cvttps_epi32(us));
+		_mm_storeu_si128((__m128i*)rows, _mm_cvttps_epi32(vs));
+		for (int k = 0; k < 4; k++) {
+			if (mask & (1 << k)) {
+				copyTexel(ppm, columns[k], rows[k], out + (i + k) * 4);
+			} else {
+				memset(out + (i + k) * 4, 0, 4);
+			}
+		}
+	}
+#endif
+
+	for (; i < count; i++) {
+		float x = u + i * step[0];
+		float y = v + i * step[1];
+
+		if (x >= 0 && x < ppm->width && y >= 0 && y < ppm->height) {
+			copyTexel(ppm, (int)x, (int)y, out + i * 4);
+		} else {
+			memset(out + i * 4, 0, 4);
+		}
+	}
+}
+
+unsigned loadTexel(const PPMImage* ppm, int column, int row) {
+	const unsigned char* texel = ppm->pixels + ((size_t)row * ppm->width + column) * 3;
+	return texel[0] | texel[1] << 8 | texel[2] << 16;
+}
+
+// Blends the four texels around (x, y) with 8-bit fractional weights, clamping
+// to the edge of the image like GL_CLAMP_TO_EDGE. The SSE2 and scalar paths
+// round identically, so output does not depend on the build.
+void blendTexels(const PPMImage* ppm, float x, float y, unsigned char* out) {
+	float left = floorf(x - 0.5f);
+	float bottom = floorf(y - 0.5f);
+	int fx = (int)((x - 0.5f - left) * 256 + 0.5f);
+	int fy = (int)((y - 0.5f - bottom) * 256 + 0.5f);
+	int x0 = (int)left < 0 ? 0 : (int)left;
+	int y0 = (int)bottom < 0 ? 0 : (int)bottom;
+	int x1 = (int)left + 1 < ppm->width ? (int)left + 1 : ppm->width - 1;
+	int y1 = (int)bottom + 1 < ppm->height ? (int)bottom + 1 : ppm->height - 1;
+	unsigned p00 = loadTexel(ppm, x0, y0);
+	unsigned p10 = loadTexel(ppm, x1, y0);
+	unsigned p01 = loadTexel(ppm, x0, y1);
+	unsigned p11 = loadTexel(ppm, x1, y1);
+
+#ifdef EZVIEW_SSE2
+	__m128i zero = _mm_setzero_si128();
+	__m128i round = _mm_set1_epi16(128);
+	__m128i lower = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, (int)p10, (int)p00), zero);
+	__m128i upper = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, (int)p11, (int)p01), zero);
+
+	// Both columns are blended vertically at once, then the two are folded together
+	__m128i column = _mm_add_epi16(_mm_mullo_epi16(lower, _mm_set1_epi16((short)(256 - fy))),
+				       _mm_mullo_epi16(upper, _mm_set1_epi16((short)fy)));
+	column = _mm_srli_epi16(_mm_add_epi16(column, round), 8);
+	column = _mm_mullo_epi16(column, _mm_set_epi16(fx, fx, fx, fx, 256 - fx, 256 - fx, 256 - fx, 256 - fx));
+	column = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(column, _mm_srli_si128(column, 8)), round), 8);
+	unsigned texel = (unsigned)_mm_cvtsi128_si32(_mm_packus_epi16(column, zero));
+	out[0] = texel & 255;
+	out[1] = texel >> 8 & 255;
+	out[2] = texel >> 16 & 255;
+#else
+	for (int c = 0; c < 3; c++) {
+		unsigned a = ((p00 >> c * 8 & 255) * (256 - fy) + (p01 >> c * 8 & 255) * fy + 128) >> 8;
+		unsigned b = ((p10 >> c * 8 & 255) * (256 - fy) + (p11 >> c * 8 & 255) * fy + 128) >> 8;
+		out[c] = (a * (256 - fx) + b * fx + 128) >> 8;
+	}
+#endif
+	out[3] = 255;
+}
+
+// Draws count pixels along a row starting at texel (u, v), blending the four
+// nearest texels, like GL_LINEAR.
+void sampleBilinear(const PPMImage* ppm, float u, float v, const float* step, int count, unsigned char* out) {
+	int i = 0;
+
+#ifdef EZVIEW_SSE2
+	__m128 lane = _mm_set_ps(3, 2, 1, 0);
+	__m128 zero = _mm_setzero_ps();
+	__m128 width = _mm_set1_ps((float)ppm->width);
+	__m128 height = _mm_set1_ps((float)ppm->height);
+	float xs[4], ys[4];
+
+	for (; i + 4 <= count; i += 4) {
+		__m128 index = _mm_add_ps(_mm_set1_ps((float)i), lane);
+		__m128 us = _mm_add_ps(_mm_set1_ps(u), _mm_mul_ps(index, _mm_set1_ps(step[0])));
+		__m128 vs = _mm_add_ps(_mm_set1_ps(v), _mm_mul_ps(index, _mm_set1_ps(step[1])));
+		__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(us, zero), _mm_cmplt_ps(us, width)),
+					   _mm_and_ps(_mm_cmpge_ps(vs, zero), _mm_cmplt_ps(vs, height)));
+		int mask = _mm_movemask_ps(inside);
+
+		_mm_storeu_ps(xs, us);
+		_mm_storeu_ps(ys, vs);
+		for (int k = 0; k < 4; k++) {
+			if (mask & (1 << k)) {
+				blendTexels(ppm, xs[k], ys[k], out + (i + k) * 4);
+			} else {
+				memset(out + (i + k) * 4, 0, 4);
+			}
+		}
+	}
+#endif
+
+	for (; i < count; i++) {
+		float x = u + i * step[0];
+		float y = v + i * step[1];
+
+		if (x >= 0 && x < ppm->width && y >= 0 && y < ppm->height) {
+			blendTexels(ppm, x, y, out + i * 4);
+		} else {
+			memset(out + i * 4, 0, 4);
+		}
+	}
+}
+
+void renderSoftwareBlock(void* context, int index) {
+	SoftwareJob* job = context;
+	int left = index % job->columns * SOFTWARE_BLOCK_SIZE;
+	int bottom = index / job->columns * SOFTWARE_BLOCK_SIZE;
+	int right = left + SOFTWARE_BLOCK_SIZE < job->width ? left + SOFTWARE_BLOCK_SIZE : job->width;
+	int top = bottom + SOFTWARE_BLOCK_SIZE < job->height ? bottom + SOFTWARE_BLOCK_SIZE : job->height;
+
+	for (int y = bottom; y < top; y++) {
+		float u = job->origin[0] + left * job->stepX[0] + y * job->stepY[0];
+		float v = job->origin[1] + left * job->stepX[1] + y * job->stepY[1];
+		unsigned char* out = job->pixels + ((size_t)y * job->width + left) * 4;
+
+		if (software_filter == 'b') {
+			sampleBilinear(job->ppm, u, v, job->stepX, right - left, out);
+		} else {
+			sampleNearest(job->ppm, u, v, job->stepX, right - left, out);
+		}
+	}
+}
+
+// Maps the centre of output pixel (x, y) back to a texel position in the image.
+void unprojectPixel(mat4x4 inverse, const PPMImage* ppm, int width, int height, int x, int y, float* texel) {
+	vec4 ndc = { (x + 0.5f) * 2 / width - 1, (y + 0.5f) * 2 / height - 1, 0, 1 };
+	vec4 position;
+
+	mat4x4_mul_vec4(position, inverse, ndc);
+	texel[0] = (position[0] + ppm->width / (float)width) * width / 2;
+	texel[1] = (position[1] + ppm->height / (float)height) * height / 2;
+}
+
+// Draws the loaded image with the current transform on the CPU and returns
+// bottom-up RGBA rows, the same as renderOffscreen.
+unsigned char* renderSoftware(int width, int height) {
+	SoftwareJob job;
+	mat4x4 mvp, inverse;
+	float right[2], up[2];
+
+	// The samplers read 8 bit texels
+	if (image.sampleBytes == 2) {
+		narrowImage(&image);
+	}
+
+	job.ppm = &image;
+	job.width = width;
+	job.height = height;
+	job.columns = (width + SOFTWARE_BLOCK_SIZE - 1) / SOFTWARE_BLOCK_SIZE;
+	job.pixels = malloc((size_t)width * height * 4);
+	if (job.pixels == NULL) {
+		fprintf(stderr, "Error: Not enough memory for output.\n");
+		exit(1);
+	}
+
+	// The transform is affine, so texel positions change by a fixed step per pixel
+	buildMVP(mvp);
+	mat4x4_invert(inverse, mvp);
+	unprojectPixel(inverse, &image, width, height, 0, 0, job.origin);
+	unprojectPixel(inverse, &image, width, height, 1, 0, right);
+	unprojectPixel(inverse, &image, width, height, 0, 1, up);
+	for (int i = 0; i < 2; i++) {
+		job.stepX[i] = right[i] - job.origin[i];
+		job.stepY[i] = up[i] - job.origin[i];
+	}
+
+	parallelFor(job.columns * ((height + SOFTWARE_BLOCK_SIZE - 1) / SOFTWARE_BLOCK_SIZE), renderSoftwareBlock, &job);
+	return job.pixels;
+}
+
+unsigned char* renderImage(int width, int height) {
+	double start = currentTime();
+	unsigned char* pixels = software_filter ? renderSoftware(width, height) : renderOffscreen(width, height);
+
+	traceEnd("render", TRACE_MAIN, start);
+	return pixels;
+}
+
+void renderHeadless(const char* output, int width, int height) {
+	unsigned char* pixels = renderImage(width, height);
+	writePPM(output, pixels, width, height);
+	free(pixels);
+}
+
+// Batch mode runs every input through decode -> render -> encode. Decoding
+// and encoding run on pools of threads; rendering stays on the thread that
+// owns the headless context. Bounded queues between the stages keep all
+// three busy at once without holding more than a few images in memory.
+#define BATCH_QUEUE_SIZE 8
+
+typedef struct {
+	void* items[BATCH_QUEUE_SIZE];
+	int head;
+	int count;
+	int producers;	// The queue is finished once every producer is done
+	Mutex lock;
+	Condition changed;
+} BatchQueue;
+
+typedef struct {
+	const char* input;
+	char* output;
+	PPMImage ppm;
+	unsigned char* pixels;	// Rendered RGBA, bottom-up
+} BatchItem;
+
+BatchItem* batch_items;
+int batch_count;
+volatile long batch_next;
+const char* batch_directory;
+int batch_width;
+int batch_height;
+BatchQueue batch_decoded;
+BatchQueue batch_rendered;
+
+void initBatchQueue(BatchQueue* queue, int producers) {
+	queue->head = 0;
+	queue->count = 0;
+	queue->producers = producers;
+	initMutex(&queue->lock);
+	initCondition(&queue->changed);
+}
+
+void pushBatch(BatchQueue* queue, void* item) {
+	lockMutex(&queue->lock);
+	while (queue->count == BATCH_QUEUE_SIZE) {
+		waitCondition(&queue->changed, &queue->lock);
+	}
+	queue->items[(queue->head + queue->count++) % BATCH_QUEUE_SIZE] = item;
+	broadcastCondition(&queue->changed);
+	unlockMutex(&queue->lock);
+}
+
+// Returns NULL once the queue is empty and its producers have all finished.
+void* popBatch(BatchQueue* queue) {
+	void* item = NULL;
+
+	lockMutex(&queue->lock);
+	while (queue->count == 0 && queue->producers > 0) {
+		waitCondition(&queue->changed, &queue->lock);
+	}
+	if (queue->count > 0) {
+		item = queue->items[queue->head];
+		queue->head = (queue->head + 1) % BATCH_QUEUE_SIZE;
+		queue->count--;
+		broadcastCondition(&queue->changed);
+	}
+	unlockMutex(&queue->lock);
+	return item;
+}
+
+void finishBatch(BatchQueue* queue) {
+	lockMutex(&queue->lock);
+	queue->producers--;
+	broadcastCondition(&queue->changed);
+	unlockMutex(&queue->lock);
+}
+
+ThreadResult THREAD_CALL runBatchDecoder(void* arg) {
+	int index;
+
+	while ((index = (int)atomicIncrement(&batch_next) - 1) < batch_count) {
+		BatchItem* item = &batch_items[index];
+		FILE* fh = fopen(item->input, "rb");
+
+		if (fh == NULL) {
+			fprintf(stderr, "Error: Input file not found: %s\n", item->input);
+			exit(1);
+		}
+		double start = currentTime();
+		item->ppm.singleThreaded = 1;
+		loadPPM(fh, &item->ppm);
+		fclose(fh);
+		traceEnd("load", TRACE_LOADER, start);
+		pushBatch(&batch_decoded, item);
+	}
+	finishBatch(&batch_decoded);
+	return 0;
+}
+
+ThreadResult THREAD_CALL runBatchEncoder(void* arg) {
+	BatchItem* item;
+
+	while ((item = popBatch(&batch_rendered)) != NULL) {
+		writePPM(item->output, item->pixels, batch_width, batch_height);
+		free(item->pixels);
+		item->pixels = NULL;
+	}
+	return 0;
+}
+
+RenderTarget batch_target;
+int batch_renderer;	// Set once the GL renderer for the batch exists
+int batch_image_width;	// Size and depth of the image its tiles were made for
+int batch_image_height;
+int batch_sample_bytes;
+
+// Renders a batch image through GL. The program and render target are made
+// for the first image and kept for the whole batch. The tiles are kept too,
+// and only their contents replaced, while images have the same size and bit
+// depth.
+unsigned char* renderBatchFrame() {
+	float x = image.width / (float)batch_width;
+	float y = image.height / (float)batch_height;
+
+	if (!batch_renderer) {
+		createRenderTarget(&batch_target, batch_width, batch_height);
+		createRenderer(x, y);
+		batch_renderer = 1;
+	} else if (image.width != batch_image_width || image.height != batch_image_height ||
+		   image.sampleBytes != batch_sample_bytes) {
+		destroyGeometry();
+		createGeometry(x, y);
+	}
+	batch_image_width = image.width;
+	batch_image_height = image.height;
+	batch_sample_bytes = image.sampleBytes;
+
+	tiles_uploaded = 0;
+	receiveTileRows();
+	while (tiles_uploaded < tile_count) {
+		uploadTiles();
+	}
+	return readFrame(batch_width, batch_height);
+}
+
+void renderBatchItem(BatchItem* item) {
+	double start = currentTime();
+
+	image = item->ppm;
+	item->pixels = software_filter ? renderSoftware(batch_width, batch_height) : renderBatchFrame();
+	traceEnd("render", TRACE_MAIN, start);
+	freeImage(&image);
+}
+
+// Appends the paths listed one per line in list ("-" for standard input).
+const char** readBatchList(const char* list, const char** inputs, int* count) {
+	FILE* fh = strcmp(list, "-") ? fopen(list, "r") : stdin;
+	char line[4096];
+	int capacity = *count;
+
+	if (fh == NULL) {
+		fprintf(stderr, "Error: Input list not found.\n");
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fh) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0') {
+			continue;
+		}
+		if (*count == capacity) {
+			capacity = capacity * 2 + 16;
+			inputs = realloc(inputs, sizeof(char*) * capacity);
+			if (inputs == NULL) {
+				fprintf(stderr, "Error: Not enough memory for batch.\n");
+				exit(1);
+			}
+		}
+		inputs[(*count)++] = strdup(line);
+	}
+	if (fh != stdin) {
+		fclose(fh);
+	}
+	return inputs;
+}
+
+// Frees the input array along with the paths readBatchList added to it, which
+// start at first.
+void freeInputs(const char** inputs, int first, int count) {
+	for (int i = first; i < count; i++) {
+		free((char*)inputs[i]);
+	}
+	free(inputs);
+}
+
+// Writes each input, transformed, to a file of the same name in directory.
+void runBatch(const char** inputs, int count, const char* directory, int width, int height) {
+	int decoders = getWorkerThreads() > 1 ? getWorkerThreads() - 1 : 1;
+	int encoders = decoders < 2 ? decoders : 2;
+	Thread* threads = malloc(sizeof(Thread) * (decoders + encoders));
+	int started = 0;
+	double start = currentTime();
+
+	batch_items = calloc(count, sizeof(BatchItem));
+	if (threads == NULL || batch_items == NULL) {
+		fprintf(stderr, "Error: Not enough memory for batch.\n");
+		exit(1);
+	}
+	batch_count = count;
+	batch_width = width;
+	batch_height = height;
+	for (int i = 0; i < count; i++) {
+		const char* name = inputs[i];
+		const char* separator = strrchr(name, '/');
+#ifdef _WIN32
+		const char* backslash = strrchr(name, '\\');
+		if (backslash != NULL && (separator == NULL || backslash > separator)) {
+			separator = backslash;
+		}
+#endif
+		name = separator != NULL ? separator + 1 : name;
+
+		batch_items[i].input = inputs[i];
+		batch_items[i].output = malloc(strlen(directory) + strlen(name) + 2);
+		sprintf(batch_items[i].output, "%s/%s", directory, name);
+	}
+
+	initBatchQueue(&batch_decoded, decoders);
+	initBatchQueue(&batch_rendered, 1);
+	for (int i = 0; i < decoders + encoders; i++) {
+		if (startThread(&threads[started], i < decoders ? runBatchDecoder : runBatchEncoder, NULL)) {
+			started++;
+		} else if (i < decoders) {
+			finishBatch(&batch_decoded);
+		}
+	}
+	if (started == 0) {
+		fprintf(stderr, "Error: Unable to start batch threads.\n");
+		exit(1);
+	}
+
+	// Every image of a size is staged the same way, so keep the staging
+	tile_staging_kept = 1;
+	BatchItem* item;
+	while ((item = popBatch(&batch_decoded)) != NULL) {
+		renderBatchItem(item);
+		pushBatch(&batch_rendered, item);
+	}
+	finishBatch(&batch_rendered);
+	if (batch_renderer) {
+		destroyRenderer();
+		destroyRenderTarget(&batch_target);
+		batch_renderer = 0;
+	}
+	tile_staging_kept = 0;
+
+	for (int i = 0; i < started; i++) {
+		joinThread(threads[i]);
+	}
+
+	double elapsed = currentTime() - start;
+	fprintf(stderr, "Rendered %d images in %.3f s (%.2f images/s)\n",
+		count, elapsed, elapsed > 0 ? count / elapsed : 0);
+
+	for (int i = 0; i < count; i++) {
+		free(batch_items[i].output);
+	}
+	free(batch_items);
+	free(threads);
+}
+
+// Playback shows a sequence of images as a flipbook. Decoder threads fill a
+// ring of frames ahead of the one on screen, looping over the inputs, and each
+// frame replaces the contents of the same tiles. A frame whose time has passed
+// by the time a newer one is ready is dropped rather than shown late.
+#define FLIPBOOK_RING_SIZE 8
+
+typedef struct {
+	PPMImage ppm;
+	long frame;	// Frame the slot holds, or is waiting for
+	int ready;
+} FlipbookSlot;
+
+FlipbookSlot flipbook_ring[FLIPBOOK_RING_SIZE];
+const char** flipbook_inputs;
+int flipbook_count;	// Inputs in the sequence, 0 when viewing one image
+float flipbook_fps = 24;
+volatile long flipbook_next;	// Next frame for a decoder to take
+long flipbook_shown;	// Frame on screen
+long flipbook_dropped;
+double flipbook_start;
+Mutex flipbook_lock;
+Condition flipbook_changed;
+Thread* flipbook_threads;
+int flipbook_thread_count;
+
+ThreadResult THREAD_CALL runFlipbookDecoder(void* arg) {
+	for (;;) {
+		long frame = atomicIncrement(&flipbook_next) - 1;
+		FlipbookSlot* slot = &flipbook_ring[frame % FLIPBOOK_RING_SIZE];
+		const char* input = flipbook_inputs[frame % flipbook_count];
+
+		// Wait for the frame a lap behind to leave the slot
+		lockMutex(&flipbook_lock);
+		while (slot->frame != frame && !atomicLoad(&loading_cancelled)) {
+			waitCondition(&flipbook_changed, &flipbook_lock);
+		}
+		unlockMutex(&flipbook_lock);
+		if (atomicLoad(&loading_cancelled)) {
+			return 0;
+		}
+
+		FILE* fh = fopen(input, "rb");
+		if (fh == NULL) {
+			fprintf(stderr, "Error: Input file not found: %s\n", input);
+			exit(1);
+		}
+		double start = currentTime();
+		slot->ppm.singleThreaded = 1;
+		loadPPM(fh, &slot->ppm);
+		fclose(fh);
+		traceEnd("load", TRACE_LOADER, start);
+
+		lockMutex(&flipbook_lock);
+		slot->ready = 1;
+		broadcastCondition(&flipbook_changed);
+		unlockMutex(&flipbook_lock);
+		if (atomicLoad(&window_open)) {
+			glfwPostEmptyEvent();
+		}
+	}
+}
+
+// Hands a slot on to the frame a lap ahead. Called with flipbook_lock held.
+void releaseFlipbookSlot(FlipbookSlot* slot) {
+	freeImage(&slot->ppm);
+	slot->ready = 0;
+	slot->frame += FLIPBOOK_RING_SIZE;
+	broadcastCondition(&flipbook_changed);
+}
+
+// Starts the decoders and waits for the first frame, which becomes the image.
+void startFlipbook() {
+	flipbook_thread_count = getWorkerThreads() > 1 ? getWorkerThreads() - 1 : 1;
+	if (flipbook_thread_count > FLIPBOOK_RING_SIZE) {
+		flipbook_thread_count = FLIPBOOK_RING_SIZE;
+	}
+	flipbook_threads = malloc(sizeof(Thread) * flipbook_thread_count);
+	if (flipbook_threads == NULL) {
+		fprintf(stderr, "Error: Not enough memory for playback.\n");
+		exit(1);
+	}
+
+	initMutex(&flipbook_lock);
+	initCondition(&flipbook_changed);
+	for (int i = 0; i < FLIPBOOK_RING_SIZE; i++) {
+		flipbook_ring[i].frame = i;
+	}
+	int started = 0;
+	for (int i = 0; i < flipbook_thread_count; i++) {
+		if (startThread(&flipbook_threads[started], runFlipbookDecoder, NULL)) {
+			started++;
+		}
+	}
+	flipbook_thread_count = started;
+	if (started == 0) {
+		fprintf(stderr, "Error: Unable to start playback threads.\n");
+		exit(1);
+	}
+
+	FlipbookSlot* slot = &flipbook_ring[0];
+	lockMutex(&flipbook_lock);
+	while (!slot->ready) {
+		waitCondition(&flipbook_changed, &flipbook_lock);
+	}
+	image = slot->ppm;
+	slot->ppm.mapping = NULL;
+	slot->ppm.pixels = NULL;
+	releaseFlipbookSlot(slot);
+	unlockMutex(&flipbook_lock);
+
+	// Every frame is staged the same way, so keep the staging between frames
+	tile_staging_kept = 1;
+	flipbook_shown = 0;
+}
+
+// Seconds until the next frame is due, for sleeping between frames.
+double flipbookDelay() {
+	return flipbook_start + (flipbook_shown + 1) / flipbook_fps - currentTime();
+}
+
+// Shows the newest decoded frame that is due, dropping any older ones it
+// overtakes. Returns 1 when a new frame replaced the image.
+int advanceFlipbook() {
+	long due = (long)((currentTime() - flipbook_start) * flipbook_fps);
+	FlipbookSlot* slot = NULL;
+
+	// The previous frame has to be on the tiles before the next replaces it
+	if (tiles_uploaded < tile_count) {
+		return 0;
+	}
+
+	lockMutex(&flipbook_lock);
+	while (flipbook_shown < due) {
+		FlipbookSlot* next = &flipbook_ring[(flipbook_shown + 1) % FLIPBOOK_RING_SIZE];
+		if (!next->ready) {
+			break;
+		}
+		if (slot != NULL) {
+			releaseFlipbookSlot(slot);
+			flipbook_dropped++;
+		}
+		slot = next;
+		flipbook_shown++;
+	}
+	unlockMutex(&flipbook_lock);
+	if (slot == NULL) {
+		return 0;
+	}
+
+	if (slot->ppm.width != image.width || slot->ppm.height != image.height) {
+		fprintf(stderr, "Error: Every image in a sequence must be the same size.\n");
+		exit(1);
+	}
+	if (slot->ppm.sampleBytes != image.sampleBytes) {
+		fprintf(stderr, "Error: Every image in a sequence must have the same bit depth.\n");
+		exit(1);
+	}
+	freeImage(&image);
+	image = slot->ppm;
+	tiles_uploaded = 0;
+	while (tiles_uploaded < tile_count) {
+		uploadTiles();
+	}
+
+	// The tiles hold the frame now, so its pixels can go back to the ring
+	lockMutex(&flipbook_lock);
+	releaseFlipbookSlot(slot);
+	unlockMutex(&flipbook_lock);
+	image.pixels = NULL;
+	image.mapping = NULL;
+	return 1;
+}
+
+void stopFlipbook() {
+	lockMutex(&flipbook_lock);
+	atomicStore(&loading_cancelled, 1);
+	broadcastCondition(&flipbook_changed);
+	unlockMutex(&flipbook_lock);
+	for (int i = 0; i < flipbook_thread_count; i++) {
+		joinThread(flipbook_threads[i]);
+	}
+	for (int i = 0; i < FLIPBOOK_RING_SIZE; i++) {
+		freeImage(&flipbook_ring[i].ppm);
+	}
+	free(flipbook_threads);
+
+	fprintf(stderr, "Played %ld frames, dropped %ld\n", flipbook_shown + 1 - flipbook_dropped, flipbook_dropped);
+}
+
+// --benchmark times decoding, tile upload and rendering of synthetic images of
+// the given sizes, printing one JSON object per format and size to standard
+// output for regression tracking. Images are noise from a fixed seed, so every
+// run decodes the same bytes. Each decode is the median of BENCHMARK_RUNS, and
+// rendering follows a fixed sequence of transforms.
+#define BENCHMARK_RUNS 3
+#define BENCHMARK_FRAMES 60
+
+unsigned benchmark_random;
+
+unsigned nextRandom() {
+	benchmark_random ^= benchmark_random << 13;
+	benchmark_random ^= benchmark_random >> 17;
+	benchmark_random ^= benchmark_random << 5;
+	return benchmark_random;
+}
+
+// Writes a width x height image of random samples to a temporary file and
+// returns it rewound.
+FILE* createSyntheticPPM(int type, int width, int height) {
+	FILE* fh = tmpfile();
+	size_t rowBytes = (size_t)width * 3;
+	unsigned char* samples = malloc(rowBytes + 4);
+	char* text = malloc(rowBytes * 4 + 1);
+
+	if (fh == NULL || samples == NULL || text == NULL) {
+		fprintf(stderr, "Error: Unable to create benchmark image.\n");
+		exit(1);
+	}
+
+	benchmark_random = 2463534242u;
+	fprintf(fh, "P%c\n%d %d\n255\n", type, width, height);
+	for (int y = 0; y < height; y++) {
+		for (size_t i = 0; i < rowBytes; i += 4) {
+			unsigned value = nextRandom();
+			memcpy(samples + i, &value, 4);
+		}
+		if (type == '6') {
+			fwrite(samples, 1, rowBytes, fh);
+			continue;
+		}
+
+		char* out = text;
+		for (size_t i = 0; i < rowBytes; i++) {
+			unsigned value = samples[i];
+			if (value >= 100) {
+				*out++ = '0' + value / 100;
+			}
+			if (value >= 10) {
+				*out++ = '0' + value / 10 % 10;
+			}
+			*out++ = '0' + value % 10;
+			*out++ = i + 1 < rowBytes ? ' ' : '\n';
+		}
+		fwrite(text, 1, out - text, fh);
+	}
+
+	free(samples);
+	free(text);
+	if (fflush(fh) != 0 || ferror(fh)) {
+		fprintf(stderr, "Error: Unable to create benchmark image.\n");
+		exit(1);
+	}
+	rewind(fh);
+	return fh;
+}
+
+// Times the parser decodeP3 replaced, which read a character at a time with
+// fgetc and converted each sample with atoi, as the baseline for P3 decode
+// figures. Only takes the single-space separated samples the generator writes.
+double benchmarkReferenceP3(FILE* fh, int width, int height) {
+	size_t count = (size_t)width * height * 3;
+	unsigned char* out = malloc(count);
+	char value[4];
+
+	if (out == NULL) {
+		fprintf(stderr, "Error: Unable to allocate memory.\n");
+		exit(1);
+	}
+
+	rewind(fh);
+	for (int lines = 0; lines < 3; ) {	// Magic number, size and maximum value
+		lines += fgetc(fh) == '\n';
+	}
+	double start = currentTime();
+	for (size_t n = 0; n < count; n++) {
+		int i = 0;
+		while ((value[i] = (char)fgetc(fh)) != ' ' && value[i] != '\n') {
+			if (!isdigit((unsigned char)value[i]) || ++i == 4) {
+				fprintf(stderr, "Error: Value must be a digit.\n");
+				exit(1);
+			}
+		}
+		value[i] = '\0';
+
+		int sample = atoi(value);
+		if (sample > image.maxColorValue) {
+			fprintf(stderr, "Error: Color value exceeding max.\n");
+			exit(1);
+		}
+		out[n] = (unsigned char)sample;
+	}
+	double elapsed = currentTime() - start;
+
+	free(out);
+	return elapsed;
+}
+
+// Zooms from a quarter size to twice size over a full turn, drifting off
+// centre, so both minified and magnified tiles are drawn.
+void setBenchmarkTransform(int frame) {
+	float t = frame / (float)BENCHMARK_FRAMES;
+
+	rotation = (float)(2 * PI * t);
+	scale = 0.25f + 1.75f * t;
+	trans_x = 0.5f * sinf((float)(2 * PI * t));
+	trans_y = 0.5f * cosf((float)(2 * PI * t));
+	shear = 0;
+}
+
+// Decodes the file BENCHMARK_RUNS times into image, returning the median time.
+double benchmarkDecode(FILE* fh) {
+	double times[BENCHMARK_RUNS];
+
+	for (int run = 0; run < BENCHMARK_RUNS; run++) {
+		if (run > 0) {
+			freeImage(&image);
+		}
+		rewind(fh);
+		double start = currentTime();
+		loadPPM(fh, &image);
+		times[run] = currentTime() - start;
+	}
+	qsort(times, BENCHMARK_RUNS, sizeof(double), compareTimes);
+	return times[BENCHMARK_RUNS / 2];
+}
+
+// Reads the next megapixel count from a comma separated list and returns the
+// side of a square image that size, advancing past it.
+int nextBenchmarkSize(const char** sizes) {
+	char* end;
+	double megapixels = strtod(*sizes, &end);
+	int side = (int)sqrt(megapixels * 1e6);
+
+	if (end == *sizes || (*end != ',' && *end != '\0') || side < 1) {
+		fprintf(stderr, "Error: Benchmark sizes must be given in megapixels, as in 1,16,64.\n");
+		exit(1);
+	}
+	*sizes = *end == ',' ? end + 1 : end;
+	return side;
+}
+
+void runBenchmark(const char* sizes, int width, int height) {
+	static const char types[] = { '3', '6' };
+	char filter = software_filter ? software_filter : 'b';
+	RenderTarget target;
+
+	for (const char* size = sizes; *size != '\0'; ) {
+		nextBenchmarkSize(&size);
+	}
+
+	createHeadlessContext();
+	fprintf(stderr, "Renderer: %s\n", (const char*)glGetString(GL_RENDERER));
+
+	for (const char* size = sizes; *size != '\0'; ) {
+		int side = nextBenchmarkSize(&size);
+		for (int i = 0; i < 2; i++) {
+			fprintf(stderr, "Benchmarking P%c at %dx%d\n", types[i], side, side);
+			FILE* fh = createSyntheticPPM(types[i], side, side);
+			fseek(fh, 0, SEEK_END);
+			double bytes = (double)fileOffset(fh);
+			double decode = benchmarkDecode(fh);
+			int mapped = image.mapping != NULL;	// Pages are read in during upload instead
+			char decodeFigures[112] = "\"decode_ms\":null,\"decode_mb_s\":null,\"reference_decode_mb_s\":null";
+			if (!mapped) {
+				int length = snprintf(decodeFigures, sizeof(decodeFigures), "\"decode_ms\":%.3f,\"decode_mb_s\":%.1f",
+						      decode * 1e3, bytes / decode / 1e6);
+				if (types[i] == '3') {
+					double reference = benchmarkReferenceP3(fh, side, side);
+					snprintf(decodeFigures + length, sizeof(decodeFigures) - length,
+						 ",\"reference_decode_mb_s\":%.1f", bytes / reference / 1e6);
+				} else {
+					snprintf(decodeFigures + length, sizeof(decodeFigures) - length, ",\"reference_decode_mb_s\":null");
+				}
+			}
+
+			createRenderTarget(&target, width, height);
+			double start = currentTime();
+			createRenderer(image.width / (float)width, image.height / (float)height);
+			receiveTileRows();
+			while (tiles_uploaded < tile_count) {
+				uploadTiles();
+			}
+			glFinish();
+			double upload = currentTime() - start;
+
+			start = currentTime();
+			for (int frame = 0; frame < BENCHMARK_FRAMES; frame++) {
+				setBenchmarkTransform(frame);
+				drawFrame(width, height);
+				glFinish();
+			}
+			double gpu = currentTime() - start;
+			destroyRenderer();
+			destroyRenderTarget(&target);
+
+			char kernel = software_filter;
+			software_filter = filter;
+			start = currentTime();
+			for (int frame = 0; frame < BENCHMARK_FRAMES; frame++) {
+				setBenchmarkTransform(frame);
+				free(renderSoftware(width, height));
+			}
+			double cpu = currentTime() - start;
+			software_filter = kernel;
+
+			printf("{\"format\":\"P%c\",\"width\":%d,\"height\":%d,\"file_bytes\":%.0f,"
+			       "%s,\"mapped\":%s,\"upload_ms\":%.3f,"
+			       "\"gpu_fps\":%.2f,\"cpu_fps\":%.2f,\"cpu_filter\":\"%s\",\"threads\":%d}\n",
+			       types[i], side, side, bytes, decodeFigures, mapped ? "true" : "false", upload * 1e3,
+			       BENCHMARK_FRAMES / gpu, BENCHMARK_FRAMES / cpu, filter == 'n' ? "nearest" : "bilinear",
+			       getWorkerThreads());
+			fflush(stdout);
+
+			freeImage(&image);
+			fclose(fh);
+		}
+	}
+
+	destroyHeadlessContext();
+}
+
+void printUsage()
+{
+  fprintf(stderr, "Usage: ezview [--threads n] [--mip-filter box|lanczos] [--continuous] [--no-pbo]\n"
+                  "              [--trace file.json|file.csv] [--stats] [--benchmark megapixels,...]\n"
+                  "              [--headless output.ppm | --batch directory] [--list file] [--fps n]\n"
+                  "              [--progressive] [--stream]\n"
+                  "              [--cpu nearest|bilinear] [--size WIDTHxHEIGHT] [--crop x,y,width,height]\n"
+                  "              [--translate x,y] [--rotate degrees] [--scale s] [--shear h] image.ppm...\n");
+}
+
+int main(int argc, char* argv[])
+{
+  FILE* fh;
+  const char* filename = NULL;
+  const char* headless_output = NULL;
+  const char* batch_output = NULL;
+  const char* batch_list = NULL;
+  const char* trace_output = NULL;
+  const char* benchmark_sizes = NULL;
+  const char** inputs = malloc(sizeof(char*) * argc);
+  int input_count = 0;
+  int listed_inputs;	// Where the strdup'd --list entries start
+  int output_width = 640;
+  int output_height = 480;
+  int crop[4] = { 0, 0, 0, 0 };	// x, y, width, height
+  int progressive = 0;
+  int stream = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      worker_threads = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--mip-filter") && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "box") && strcmp(argv[i], "lanczos")) {
+        printUsage();
+        free(inputs);
+        return 1;
+      }
+      mip_filter = argv[i][0];
+    } else if (!strcmp(argv[i], "--stream")) {
+      stream = 1;
+    } else if (!strcmp(argv[i], "--progressive")) {
+      progressive = 1;
+    } else if (!strcmp(argv[i], "--no-pbo")) {
+      pixel_buffers_allowed = 0;
+    } else if (!strcmp(argv[i], "--fps") && i + 1 < argc) {
+      flipbook_fps = atof(argv[++i]);
+      if (flipbook_fps <= 0) {
+        fprintf(stderr, "Error: Frame rate must be positive.\n");
+        free(inputs);
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+      trace_output = argv[++i];
+    } else if (!strcmp(argv[i], "--benchmark") && i + 1 < argc) {
+      benchmark_sizes = argv[++i];
+    } else if (!strcmp(argv[i], "--stats")) {
+      frame_stats = 1;
+    } else if (!strcmp(argv[i], "--continuous")) {
+      continuous_rendering = 1;
+    } else if (!strcmp(argv[i], "--headless") && i + 1 < argc) {
+      headless_output = argv[++i];
+    } else if (!strcmp(argv[i], "--cpu") && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "nearest") && strcmp(argv[i], "bilinear")) {
+        printUsage();
+        free(inputs);
+        return 1;
+      }
+      software_filter = argv[i][0];
+    } else if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+      batch_output = argv[++i];
+    } else if (!strcmp(argv[i], "--list") && i + 1 < argc) {
+      batch_list = argv[++i];
+    } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &output_width, &output_height) != 2 ||
+          output_width < 1 || output_height < 1) {
+        fprintf(stderr, "Error: Output size must be given as WIDTHxHEIGHT.\n");
+        free(inputs);
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--crop") && i + 1 < argc) {
+      if (sscanf(argv[++i], "%d,%d,%d,%d", &crop[0], &crop[1], &crop[2], &crop[3]) != 4 ||
+          crop[0] < 0 || crop[1] < 0 || crop[2] < 1 || crop[3] < 1) {
+        fprintf(stderr, "Error: Crop must be given as x,y,width,height.\n");
+        free(inputs);
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--translate") && i + 1 < argc) {
+      sscanf(argv[++i], "%f,%f", &trans_x, &trans_y);
+    } else if (!strcmp(argv[i], "--rotate") && i + 1 < argc) {
+      rotation = atof(argv[++i]) * PI / 180;
+    } else if (!strcmp(argv[i], "--scale") && i + 1 < argc) {
+      scale = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--shear") && i + 1 < argc) {
+      shear = atof(argv[++i]);
+    } else {
+      inputs[input_count++] = argv[i];
+    }
+  }
+
+  listed_inputs = input_count;
+  if (trace_output != NULL) {
+    startTrace();
+  }
+  if (batch_list != NULL) {
+    inputs = readBatchList(batch_list, inputs, &input_count);
+  }
+
+  if (benchmark_sizes != NULL) {
+    runBenchmark(benchmark_sizes, output_width, output_height);
+    freeInputs(inputs, listed_inputs, input_count);
+    if (trace_output != NULL) {
+      finishTrace(trace_output);
+    }
+    return 0;
+  }
+
+  if (batch_output != NULL) {
+    if (input_count == 0) {
+      fprintf(stderr, "Error: No input files for batch.\n");
+      freeInputs(inputs, listed_inputs, input_count);
+      return 1;
+    }
+    if (!software_filter) {
+      createHeadlessContext();
+    }
+    runBatch(inputs, input_count, batch_output, output_width, output_height);
+    if (!software_filter) {
+      destroyHeadlessContext();
+    }
+    freeInputs(inputs, listed_inputs, input_count);
+    if (trace_output != NULL) {
+      finishTrace(trace_output);
+    }
+    return 0;
+  }
+
+  if (input_count == 1) {
+    filename = inputs[0];
+  } else if (input_count > 1 && headless_output == NULL) {
+    flipbook_inputs = inputs;
+    flipbook_count = input_count;
+  }
+  if (filename == NULL && flipbook_count == 0) {
+    printUsage();
+    freeInputs(inputs, listed_inputs, input_count);
+    return 1;
+  }
+
+  Thread loader;
+  if (flipbook_count > 0) {
+    startFlipbook();
+  } else {
+    if (!strcmp(filename, "-")) {
+      fh = stdin;
+#ifdef _WIN32
+      _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    } else {
+      fh = fopen(filename, "rb");
+    }
+    if (fh == NULL) {
+      fprintf(stderr, "Error: Input file not found.\n");
+      freeInputs(inputs, listed_inputs, input_count);
+      return 1;
+    }
+
+    double start = currentTime();
+    image.path = fh != stdin ? filename : NULL;
+    loadPPMHeader(fh, &image);
+    traceEnd("load header", TRACE_MAIN, start);
+
+    // A region is quick to read, so it is loaded up front
+    if (crop[2] > 0) {
+      start = currentTime();
+      loadPPMRegion(fh, &image, crop[0], crop[1], crop[2], crop[3]);
+      traceEnd("load region", TRACE_MAIN, start);
+      if (fh != stdin) {
+        fclose(fh);
+      }
+      fh = NULL;
+    }
+
+    if (headless_output != NULL) {
+      if (fh != NULL) {
+        runLoader(fh);
+      }
+      if (!software_filter) {
+        createHeadlessContext();
+      }
+      renderHeadless(headless_output, output_width, output_height);
+      if (!software_filter) {
+        destroyHeadlessContext();
+      }
+      freeImage(&image);
+      freeInputs(inputs, listed_inputs, input_count);
+      if (trace_output != NULL) {
+        finishTrace(trace_output);
+      }
+      return 0;
+    }
+
+    // Previews need rows read out of order, which only a mapped P6 file allows
+    progressive_loading = progressive && fh != NULL && image.type == '6' && image.mapping != NULL;
+    streaming = stream && fh != NULL;
+    if (fh != NULL) {
+      loading_async = 1;
+      if (!startThread(&loader, runLoader, fh)) {
+        loading_async = 0;
+        streaming = 0;
+        runLoader(fh);
+      }
+    }
+  }
+
+    GLFWwindow* window;
+
+    glfwSetErrorCallback(error_callback);
+
+    if (!glfwInit())
+        exit(EXIT_FAILURE);
+
+    glfwDefaultWindowHints();
+    glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+
+    int windowWidth = output_width;
+    int windowHeight = output_height;
+
+    window = glfwCreateWindow(windowWidth, windowHeight, "ezview", NULL, NULL);
+    if (!window)
+    {
+        glfwTerminate();
+        exit(EXIT_FAILURE);
+    }
+
+    glfwSetKeyCallback(window, key_callback);
+    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwSetWindowRefreshCallback(window, window_refresh_callback);
+    atomicStore(&window_open, 1);
+
+    glfwMakeContextCurrent(window);
+    // gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
+    glfwSwapInterval(1);
+
+    // NOTE: OpenGL error checks have been omitted for brevity
+
+    createRenderer(image.width / (float)windowWidth,
+                   image.height / (float)windowHeight);
+    flipbook_start = currentTime();
+    double stats_shown = 0;
+
+    while (!glfwWindowShouldClose(window))
+    {
+        int width, height;
+
+        if (receivePreview()) {
+            frame_dirty = 1;
+        }
+        if (receiveTileRows()) {
+            frame_dirty = 1;
+        }
+        if (uploadTiles()) {
+            frame_dirty = 1;
+        }
+        if (flipbook_count > 0 && advanceFlipbook()) {
+            frame_dirty = 1;
+        }
+
+        if (frame_dirty || continuous_rendering) {
+            double start = currentTime();
+            frame_dirty = 0;
+
+            glfwGetFramebufferSize(window, &width, &height);
+            drawFrame(width, height);
+
+            double swap = currentTime();
+            glfwSwapBuffers(window);
+            traceEnd("swap", TRACE_MAIN, swap);
+            traceEnd("frame", TRACE_MAIN, start);
+            recordFrameTime(currentTime() - start);
+        }
+        collectGPUTimers();
+
+        if (frame_stats && currentTime() - stats_shown > 0.5) {
+            char title[128];
+            double p50, p99;
+
+            frameTimePercentiles(&p50, &p99);
+            snprintf(title, sizeof(title), "ezview - frame p50 %.2f ms, p99 %.2f ms, gpu %.2f ms",
+                     p50 * 1e3, p99 * 1e3, gpu_frame_time * 1e3);
+            glfwSetWindowTitle(window, title);
+            stats_shown = currentTime();
+        }
+
+        // Sleep until something happens unless tiles are waiting to be uploaded.
+        // While the loader runs, the timeout covers a wake-up posted before the
+        // window was open.
+        if (continuous_rendering || tileReady(tiles_uploaded)) {
+            glfwPollEvents();
+        } else if (loading_async && rows_ready < image.height) {
+            glfwWaitEventsTimeout(0.1);
+        } else if (flipbook_count > 0) {
+            // A late frame's decoder posts an event when it finishes
+            double delay = flipbookDelay();
+            glfwWaitEventsTimeout(delay > 0 ? delay : 0.1);
+        } else {
+            glfwWaitEvents();
+        }
+    }
+
+    // The loader and flipbook decoders wake the window with empty events, so
+    // they have to be stopped before GLFW goes away
+    if (loading_async) {
+      atomicStore(&loading_cancelled, 1);
+      joinThread(loader);
+    }
+    if (flipbook_count > 0) {
+      stopFlipbook();
+    }
+    atomicStore(&window_open, 0);
+    deleteGPUTimers();
+    deleteTiles();
+    glfwDestroyWindow(window);
+
+    glfwTerminate();
+
+    freePreviews();
+
+    freeImage(&image);
+    freeInputs(inputs, listed_inputs, input_count);
+    if (trace_output != NULL) {
+      finishTrace(trace_output);
+    }
     exit(EXIT_SUCCESS);
 }
 